@@ -0,0 +1,309 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mmpool.h"
+
+/*
+** Aging benchmark of fragmentation. It runs phases of workloads in turn,
+** each with its own distribution of sizes and lifetimes, and some objects
+** of a phase survive into the next ones. The memory efficiency is sampled
+** as CSV over time, so the drift of RSS and mapped size over the live size
+** could be plotted and compared between versions.
+**
+** usage: mm_aging [-s] [-n ops] [-i interval] [-d deferred] [-a arenas]
+**		[-r seed] [-p pool_csv]
+**	-s	run on the system allocator instead of mmpool, only live
+**		and RSS are sampled then.
+**	-n	number of operations, 20000000 by default.
+**	-i	operations between samples, 100000 by default.
+**	-d	size limit of deferred coalescing per pool.
+**	-a	number of arenas, 0 for one per CPU.
+**	-r	seed of the random workload, the same seed runs the same.
+**	-p	also write a CSV of each pool for each sample to the file.
+** The samples are written to stdout with the columns:
+**	ops,phase,live,mapped,rss,alloc_rss,free_blocks,largest_free,fragmentation
+** where alloc_rss is the RSS over the baseline taken before the pool is
+** created, i.e. without the arrays of the benchmark itself, and the
+** fragmentation is the one of mmpool_get_stats, per pool: 1 - the sum of
+** the largest free block of each pool / the free size of all pools,
+** and the pool CSV has the columns:
+**	ops,pool,arena,size,used,free_blocks,largest_free
+*/
+
+typedef struct aging_phase
+{
+	const char *name;
+	unsigned int min_size;		/* sizes are log uniform in the range */
+	unsigned int max_size;
+	unsigned int min_life;		/* lifetime in operations, uniform */
+	unsigned int max_life;
+	unsigned int survive;		/* per mille of objects living long */
+}AGING_PHASE;
+
+static const AGING_PHASE g_phases[] =
+{
+	{"small-short",	16,	512,	1,	2000,	10},
+	{"large-long",	4096,	65536,	100,	10000,	50},
+	{"mixed",	16,	65536,	1,	30000,	20},
+	{"medium-churn", 512,	8192,	1,	5000,	0},
+	{"tiny-burst",	16,	128,	1000,	50000,	5},
+};
+#define PHASE_NUM (int)(sizeof(g_phases) / sizeof(g_phases[0]))
+#define PHASE_OPS 1000000		/* operations of a phase before the next */
+
+/*
+** Objects are freed by a timing wheel of lifetimes, the survivors live up
+** to WHEEL_SIZE operations, across a few phases.
+*/
+#define WHEEL_SIZE (1 << 21)
+#define MAX_OBJ (1 << 21)
+
+static void **g_addr;
+static unsigned int *g_size;
+static int *g_next;			/* next object in the same wheel slot */
+static int *g_wheel;			/* first object expiring at the slot */
+static int *g_free_obj;			/* stack of free object indexes */
+static int g_free_len;
+
+static int g_system = 0;
+static MM_POOL *g_pool;
+static unsigned long long g_live = 0;
+static unsigned int g_pgsize;
+static unsigned long long g_base_rss;	/* RSS of the benchmark arrays and all */
+
+/*
+** Own random generator (xorshift64*), the workload must not depend on the
+** state of rand(), which the allocator may use as well.
+*/
+static unsigned long long g_rand_state = 1;
+
+static unsigned int aging_rand(void)
+{
+	g_rand_state ^= g_rand_state >> 12;
+	g_rand_state ^= g_rand_state << 25;
+	g_rand_state ^= g_rand_state >> 27;
+	return (unsigned int)((g_rand_state * 0x2545F4914F6CDD1DULL) >> 32);
+}
+
+static unsigned int rand_range(unsigned int min, unsigned int max)
+{
+	return min + (unsigned int)(((unsigned long long)aging_rand() * (max - min + 1)) >> 32);
+}
+
+static unsigned int rand_log_size(unsigned int min, unsigned int max)
+{
+	double r = (double)aging_rand() / 4294967296.0;
+	return (unsigned int)exp(log((double)min) + r * (log((double)max) - log((double)min)));
+}
+
+static void obj_free(int obj)
+{
+	if(g_system)
+		free(g_addr[obj]);
+	else
+		mmpool_free(g_addr[obj]);
+
+	g_live -= g_size[obj];
+	g_free_obj[g_free_len++] = obj;
+}
+
+static void obj_alloc(const AGING_PHASE *phase, unsigned long long now)
+{
+	unsigned int size, life, i;
+	unsigned char *addr;
+	int obj, slot;
+
+	if(g_free_len == 0)
+		return;
+
+	size = rand_log_size(phase->min_size, phase->max_size);
+	if(phase->survive > 0 && rand_range(1, 1000) <= phase->survive)
+		life = rand_range(WHEEL_SIZE / 2, WHEEL_SIZE - 1);
+	else
+		life = rand_range(phase->min_life, phase->max_life);
+
+	addr = g_system ? (unsigned char*)malloc(size) : (unsigned char*)mmpool_malloc(g_pool, size);
+	if(addr == NULL)
+		return;
+
+	/* touch the head and each page, like a caller filling it */
+	memset(addr, 0, size < 64 ? size : 64);
+	for(i = g_pgsize; i < size; i += g_pgsize)
+		addr[i] = 1;
+
+	obj = g_free_obj[--g_free_len];
+	g_addr[obj] = addr;
+	g_size[obj] = size;
+	g_live += size;
+
+	slot = (int)((now + life) % WHEEL_SIZE);
+	g_next[obj] = g_wheel[slot];
+	g_wheel[slot] = obj;
+}
+
+static unsigned long long rss_bytes(void)
+{
+	unsigned long long size = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if(fp == NULL)
+		return 0;
+	if(fscanf(fp, "%llu %llu", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+
+	return resident * g_pgsize;
+}
+
+static void sample(unsigned long long ops, const AGING_PHASE *phase, FILE *pool_fp)
+{
+	static MM_POOL_STATS stats;
+	unsigned long long rss = rss_bytes();
+	int i;
+
+	memset(&stats, 0, sizeof(stats));
+	if(!g_system)
+		mmpool_get_stats(g_pool, &stats);
+
+	printf("%llu,%s,%llu,%llu,%llu,%llu,%llu,%llu,%.4f\n", ops, phase->name, g_live,
+		stats.mapped_size, rss, rss > g_base_rss ? rss - g_base_rss : 0,
+		stats.free_blocks, stats.largest_free, stats.fragmentation);
+
+	if(pool_fp == NULL)
+		return;
+
+	for(i = 0; i < stats.pool_num; i++)
+	{
+		const MM_SUBPOOL_STATS *ps = &stats.pools[i];
+		fprintf(pool_fp, "%llu,%d,%d,%u,%u,%u,%u\n", ops, i, ps->arena, ps->size,
+			ps->used_size, ps->free_blocks, ps->largest_free);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long long ops = 20000000ULL, interval = 100000, now;
+	const char *pool_path = NULL;
+	FILE *pool_fp = NULL;
+	struct timeval start, stop;
+	int opt, deferred = 0, arenas = 1, i, obj;
+	unsigned int seed = 1;
+
+	while((opt = getopt(argc, argv, "sn:i:d:a:r:p:")) != -1)
+	{
+		switch(opt)
+		{
+		case 's':
+			g_system = 1;
+			break;
+		case 'n':
+			ops = strtoull(optarg, NULL, 10);
+			break;
+		case 'i':
+			interval = strtoull(optarg, NULL, 10);
+			break;
+		case 'd':
+			deferred = atoi(optarg);
+			break;
+		case 'a':
+			arenas = atoi(optarg);
+			break;
+		case 'r':
+			seed = (unsigned int)atoi(optarg);
+			break;
+		case 'p':
+			pool_path = optarg;
+			break;
+		default:
+			printf("usage: %s [-s] [-n ops] [-i interval] [-d deferred] [-a arenas] [-r seed] [-p pool_csv]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(interval == 0)
+		interval = 1;
+
+	g_pgsize = getpagesize();
+	g_addr = (void**)malloc(MAX_OBJ * sizeof(void*));
+	g_size = (unsigned int*)malloc(MAX_OBJ * sizeof(unsigned int));
+	g_next = (int*)malloc(MAX_OBJ * sizeof(int));
+	g_free_obj = (int*)malloc(MAX_OBJ * sizeof(int));
+	g_wheel = (int*)malloc(WHEEL_SIZE * sizeof(int));
+	if(!g_addr || !g_size || !g_next || !g_free_obj || !g_wheel)
+	{
+		printf("out of memory for the workload.\n");
+		return 1;
+	}
+	for(i = 0; i < MAX_OBJ; i++)
+		g_free_obj[i] = MAX_OBJ - 1 - i;
+	g_free_len = MAX_OBJ;
+	for(i = 0; i < WHEEL_SIZE; i++)
+		g_wheel[i] = -1;
+	/* fault in the rest of the arrays, so they are all in the baseline */
+	memset(g_addr, 0, MAX_OBJ * sizeof(void*));
+	memset(g_size, 0, MAX_OBJ * sizeof(unsigned int));
+	memset(g_next, 0, MAX_OBJ * sizeof(int));
+	g_base_rss = rss_bytes();
+
+	if(pool_path != NULL && !g_system)
+	{
+		pool_fp = fopen(pool_path, "w");
+		if(pool_fp == NULL)
+		{
+			printf("open pool csv %s failed.\n", pool_path);
+			return 1;
+		}
+		fprintf(pool_fp, "ops,pool,arena,size,used,free_blocks,largest_free\n");
+	}
+
+	if(!g_system)
+	{
+		g_pool = arenas == 1 ? mmpool_init() : mmpool_init_arenas(arenas);
+		if(g_pool == NULL)
+			return 1;
+		mmpool_set_deferred(g_pool, deferred);
+	}
+
+	g_rand_state = 0x9E3779B97F4A7C15ULL * (seed + 1);
+	printf("ops,phase,live,mapped,rss,alloc_rss,free_blocks,largest_free,fragmentation\n");
+
+	gettimeofday(&start, 0);
+	for(now = 0; now < ops; now++)
+	{
+		const AGING_PHASE *phase = &g_phases[(now / PHASE_OPS) % PHASE_NUM];
+		int slot = (int)(now % WHEEL_SIZE);
+
+		/* free the objects expiring now, then allocate one */
+		for(obj = g_wheel[slot]; obj >= 0; obj = g_next[obj])
+			obj_free(obj);
+		g_wheel[slot] = -1;
+
+		obj_alloc(phase, now);
+
+		if((now + 1) % interval == 0)
+			sample(now + 1, phase, pool_fp);
+	}
+	gettimeofday(&stop, 0);
+
+	fprintf(stderr, "%s: %llu ops in %lu ms\n", g_system ? "system" : "mmpool", ops,
+		(unsigned long)((stop.tv_sec - start.tv_sec) * 1000 + (stop.tv_usec - start.tv_usec) / 1000));
+
+	/* release all, the memory left in use is a leak of the benchmark */
+	for(i = 0; i < WHEEL_SIZE; i++)
+	{
+		for(obj = g_wheel[i]; obj >= 0; obj = g_next[obj])
+			obj_free(obj);
+	}
+
+	if(pool_fp != NULL)
+		fclose(pool_fp);
+	if(!g_system)
+		mmpool_destroy(g_pool);
+
+	return 0;
+}
@@ -0,0 +1,142 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <memory_resource>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "mmpool.hpp"
+
+/*
+** Container benchmark of mmpool C++ layer, compare the same workloads on
+** std::allocator, mmpool::allocator, std::pmr over mmpool::memory_resource
+** and std::pmr::monotonic_buffer_resource.
+*/
+
+#define LOOP 20
+#define VEC_NUM 1000
+#define VEC_LEN 1000
+#define MAP_NUM 100000
+
+typedef std::basic_string<char, std::char_traits<char>, mmpool::allocator<char> > mm_string;
+
+static unsigned long now_us(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, 0);
+	return tv.tv_sec * 1000000UL + tv.tv_usec;
+}
+
+/* vectors of growing ints, then released together */
+template <class Vec, class Make>
+static unsigned long bench_vector(Make make)
+{
+	unsigned long start = now_us();
+	int loop, i, j;
+
+	for(loop = 0; loop < LOOP; loop++)
+	{
+		std::vector<Vec> vecs;
+		vecs.reserve(VEC_NUM);
+		for(i = 0; i < VEC_NUM; i++)
+		{
+			vecs.push_back(make());
+			for(j = 0; j < VEC_LEN; j++)
+				vecs.back().push_back(j);
+		}
+	}
+
+	return now_us() - start;
+}
+
+/* hash map of int to string, insert all and erase the half */
+template <class Map, class Make>
+static unsigned long bench_map(Make make)
+{
+	unsigned long start = now_us();
+	int loop, i;
+
+	for(loop = 0; loop < LOOP / 4; loop++)
+	{
+		Map map = make();
+		for(i = 0; i < MAP_NUM; i++)
+			map.emplace(i, "a string value longer than sso buffer");
+		for(i = 0; i < MAP_NUM; i += 2)
+			map.erase(i);
+	}
+
+	return now_us() - start;
+}
+
+static void report(const char *name, unsigned long vec_us, unsigned long map_us)
+{
+	printf("%-28s vector: %8lu us  unordered_map: %8lu us\n", name, vec_us, map_us);
+}
+
+int main(void)
+{
+	mmpool::pool_handle pool;
+	mmpool::memory_resource mm_res(pool.get());
+	unsigned long vec_us, map_us;
+
+	mmpool::pool_registry<mmpool::default_tag>::pool() = pool.get();
+
+	/* std::allocator */
+	vec_us = bench_vector<std::vector<int> >([] { return std::vector<int>(); });
+	map_us = bench_map<std::unordered_map<int, std::string> >(
+		[] { return std::unordered_map<int, std::string>(); });
+	report("std::allocator", vec_us, map_us);
+
+	/* stateless mmpool::allocator */
+	typedef std::vector<int, mmpool::allocator<int> > mm_vector;
+	typedef std::unordered_map<int, mm_string, std::hash<int>, std::equal_to<int>,
+		mmpool::allocator<std::pair<const int, mm_string> > > mm_map;
+	vec_us = bench_vector<mm_vector>([] { return mm_vector(); });
+	map_us = bench_map<mm_map>([] { return mm_map(); });
+	report("mmpool::allocator", vec_us, map_us);
+
+	/* std::pmr on mmpool::memory_resource */
+	vec_us = bench_vector<std::pmr::vector<int> >(
+		[&] { return std::pmr::vector<int>(&mm_res); });
+	map_us = bench_map<std::pmr::unordered_map<int, std::pmr::string> >(
+		[&] { return std::pmr::unordered_map<int, std::pmr::string>(&mm_res); });
+	report("pmr mmpool::memory_resource", vec_us, map_us);
+
+	/* std::pmr on monotonic_buffer_resource, reset for each loop by scope */
+	{
+		unsigned long start;
+		int loop, i, j;
+
+		start = now_us();
+		for(loop = 0; loop < LOOP; loop++)
+		{
+			std::pmr::monotonic_buffer_resource mono;
+			std::pmr::vector<std::pmr::vector<int> > vecs(&mono);
+			vecs.reserve(VEC_NUM);
+			for(i = 0; i < VEC_NUM; i++)
+			{
+				vecs.emplace_back();
+				for(j = 0; j < VEC_LEN; j++)
+					vecs.back().push_back(j);
+			}
+		}
+		vec_us = now_us() - start;
+
+		start = now_us();
+		for(loop = 0; loop < LOOP / 4; loop++)
+		{
+			std::pmr::monotonic_buffer_resource mono;
+			std::pmr::unordered_map<int, std::pmr::string> map(&mono);
+			for(i = 0; i < MAP_NUM; i++)
+				map.emplace(i, "a string value longer than sso buffer");
+			for(i = 0; i < MAP_NUM; i += 2)
+				map.erase(i);
+		}
+		map_us = now_us() - start;
+	}
+	report("pmr monotonic_buffer", vec_us, map_us);
+
+	return 0;
+}
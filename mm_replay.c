@@ -0,0 +1,392 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "mmpool.h"
+#include "mmtrace.h"
+
+/*
+** Replay an allocation trace recorded by mmtrace_start against mmpool or
+** the system allocator, one thread for each thread of the trace, and
+** report the time, peak RSS and fragmentation.
+**
+** usage: mm_replay [-s] [-f] [-d deferred] [-a arenas] trace_file
+**	-s	replay against the system allocator instead of mmpool.
+**	-f	free running, only the free waits for its malloc, the other
+**		events of threads run concurrently. By default all events run
+**		in the original order of the trace.
+**	-d	size limit of deferred coalescing per pool.
+**	-a	number of arenas, 0 for one per CPU.
+** Run it once for each allocator. The trace loaded takes about 64 bytes per
+** event, so the RSS is sampled after loading as the baseline, and the peak
+** RSS over it in the replay is reported against the peak live size.
+*/
+
+typedef struct replay_ev
+{
+	MM_TRACE_REC rec;
+	long ref;			/* index of the malloc for a free, -1 for none */
+	long pos;			/* position in the trace, order of a thread */
+}REPLAY_EV;
+
+typedef struct replay_thread
+{
+	unsigned int tid;		/* thread id in the trace */
+	long *evs;			/* index of events of this thread in order */
+	long ev_num;
+	pthread_t th;
+}REPLAY_THREAD;
+
+#define REPLAY_FAILED ((void*)-1)	/* address of a malloc failed in replay */
+
+static REPLAY_EV *g_evs;
+static void **g_addrs;			/* address replayed of each malloc event */
+static long g_ev_num;
+static volatile long g_next = 0;	/* next event to run in the strict order */
+static int g_system = 0;
+static int g_free_running = 0;
+static MM_POOL *g_pool;
+
+static long long g_live = 0;		/* live size requested */
+static long long g_peak_live = 0;
+static long g_peak_rss = 0;		/* peak RSS sampled in the replay */
+static volatile int g_sampling = 0;
+
+static int ev_cmp(const void *a, const void *b)
+{
+	const REPLAY_EV *ea = (const REPLAY_EV*)a;
+	const REPLAY_EV *eb = (const REPLAY_EV*)b;
+
+	if(ea->rec.ts != eb->rec.ts)
+		return ea->rec.ts < eb->rec.ts ? -1 : 1;
+	/* qsort is not stable, keep the order of a thread by the position */
+	if(ea->rec.tid != eb->rec.tid)
+		return ea->rec.tid < eb->rec.tid ? -1 : 1;
+	return ea->pos < eb->pos ? -1 : (ea->pos > eb->pos);
+}
+
+static long load_trace(const char *path)
+{
+	MM_TRACE_HEAD head;
+	FILE *fp;
+	long num = 0, cap = 1024;
+
+	fp = fopen(path, "rb");
+	if(fp == NULL)
+	{
+		printf("open trace %s failed.\n", path);
+		return -1;
+	}
+
+	if(fread(&head, sizeof(head), 1, fp) != 1 || head.magic != MM_TRACE_MAGIC
+		|| head.rec_size != sizeof(MM_TRACE_REC))
+	{
+		printf("invalid trace file %s.\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	g_evs = (REPLAY_EV*)malloc(cap * sizeof(REPLAY_EV));
+	while(1)
+	{
+		if(num == cap)
+		{
+			cap *= 2;
+			g_evs = (REPLAY_EV*)realloc(g_evs, cap * sizeof(REPLAY_EV));
+		}
+		if(fread(&g_evs[num].rec, sizeof(MM_TRACE_REC), 1, fp) != 1)
+			break;
+		g_evs[num].ref = -1;
+		g_evs[num].pos = num;
+		num++;
+	}
+	fclose(fp);
+
+	qsort(g_evs, num, sizeof(REPLAY_EV), ev_cmp);
+	return num;
+}
+
+/*
+** Link each free to its malloc by the address, with an open addressing hash
+** of the last malloc of each address. A malloc is linked once at most, the
+** other frees of it are double frees and skipped.
+*/
+static void link_frees(void)
+{
+	long *table, i, mask, slot;
+	long size = 1;
+	char *linked;
+
+	while(size < 2 * g_ev_num + 2)
+		size <<= 1;
+	mask = size - 1;
+	table = (long*)malloc(size * sizeof(long));
+	for(i = 0; i < size; i++)
+		table[i] = -1;
+	linked = (char*)calloc(g_ev_num + 1, 1);
+
+	for(i = 0; i < g_ev_num; i++)
+	{
+		unsigned long long addr = g_evs[i].rec.addr;
+
+		if(addr == 0)
+			continue;
+
+		slot = (long)((addr >> 5) * 0x9E3779B97F4A7C15ULL >> 17) & mask;
+		while(table[slot] != -1 && g_evs[table[slot]].rec.addr != addr)
+			slot = (slot + 1) & mask;
+
+		if(g_evs[i].rec.op == MM_TRACE_MALLOC)
+		{
+			table[slot] = i;
+		}
+		else if(table[slot] != -1 && !linked[table[slot]])
+		{
+			g_evs[i].ref = table[slot];
+			linked[table[slot]] = 1;
+		}
+	}
+
+	free(linked);
+	free(table);
+}
+
+static void run_event(long idx)
+{
+	REPLAY_EV *ev = &g_evs[idx];
+
+	if(ev->rec.op == MM_TRACE_MALLOC)
+	{
+		void *addr;
+
+		if(ev->rec.addr == 0 || ev->rec.size == 0)
+			return;
+
+		if(g_system)
+			addr = ev->rec.align ? aligned_alloc(ev->rec.align, ev->rec.size) : malloc(ev->rec.size);
+		else
+			addr = ev->rec.align ? mmpool_aligned_alloc(g_pool, ev->rec.align, ev->rec.size)
+				: mmpool_malloc(g_pool, ev->rec.size);
+
+		/* touch the memory like the application did */
+		if(addr)
+			memset(addr, 0, ev->rec.size);
+		else
+			addr = REPLAY_FAILED;
+		g_addrs[idx] = addr;
+
+		{
+			long long live = __sync_add_and_fetch(&g_live, ev->rec.size);
+			long long peak = g_peak_live;
+
+			while(live > peak && !__sync_bool_compare_and_swap(&g_peak_live, peak, live))
+				peak = g_peak_live;
+		}
+	}
+	else if(ev->rec.op == MM_TRACE_FREE && ev->ref >= 0)
+	{
+		if(g_free_running)
+		{
+			/* wait for the malloc in another thread */
+			while(*(void* volatile*)&g_addrs[ev->ref] == NULL)
+				sched_yield();
+		}
+
+		if(g_addrs[ev->ref] == REPLAY_FAILED)
+			return;
+
+		if(g_system)
+			free(g_addrs[ev->ref]);
+		else
+			mmpool_free(g_addrs[ev->ref]);
+		__sync_sub_and_fetch(&g_live, g_evs[ev->ref].rec.size);
+	}
+}
+
+static long rss_bytes(void)
+{
+	long size = 0, resident = 0;
+	FILE *fp = fopen("/proc/self/statm", "r");
+
+	if(fp == NULL)
+		return 0;
+	if(fscanf(fp, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(fp);
+
+	return resident * getpagesize();
+}
+
+/* Sample RSS every millisecond for the peak in the replay. */
+static void *sample_func(void *arg)
+{
+	long rss;
+
+	while(g_sampling)
+	{
+		rss = rss_bytes();
+		if(rss > g_peak_rss)
+			g_peak_rss = rss;
+		usleep(1000);
+	}
+
+	return NULL;
+}
+
+static void *replay_func(void *arg)
+{
+	REPLAY_THREAD *th = (REPLAY_THREAD*)arg;
+	long i, idx;
+
+	for(i = 0; i < th->ev_num; i++)
+	{
+		idx = th->evs[i];
+
+		if(!g_free_running)
+		{
+			while(g_next != idx)
+				sched_yield();
+		}
+
+		run_event(idx);
+
+		if(!g_free_running)
+			__sync_bool_compare_and_swap(&g_next, idx, idx + 1);
+	}
+
+	return NULL;
+}
+
+int main(int argc, char *argv[])
+{
+	REPLAY_THREAD *ths;
+	int *th_idx;
+	struct timeval start, stop;
+	pthread_t sampler;
+	unsigned long us;
+	long base_rss, rss;
+	long i;
+	int th_num = 0, j, opt, deferred = 0, arenas = 1;
+
+	while((opt = getopt(argc, argv, "sfd:a:")) != -1)
+	{
+		switch(opt)
+		{
+		case 's':
+			g_system = 1;
+			break;
+		case 'f':
+			g_free_running = 1;
+			break;
+		case 'd':
+			deferred = atoi(optarg);
+			break;
+		case 'a':
+			arenas = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-s] [-f] [-d deferred] [-a arenas] trace_file\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind >= argc)
+	{
+		printf("usage: %s [-s] [-f] [-d deferred] [-a arenas] trace_file\n", argv[0]);
+		return 1;
+	}
+
+	g_ev_num = load_trace(argv[optind]);
+	if(g_ev_num < 0)
+		return 1;
+	link_frees();
+	/* touched now, so that it is counted in the baseline */
+	g_addrs = (void**)malloc((g_ev_num + 1) * sizeof(void*));
+	memset(g_addrs, 0, (g_ev_num + 1) * sizeof(void*));
+
+	/* split the events to threads of the trace, in the order of time */
+	th_idx = (int*)malloc((g_ev_num + 1) * sizeof(int));
+	ths = NULL;
+	for(i = 0; i < g_ev_num; i++)
+	{
+		for(j = 0; j < th_num; j++)
+		{
+			if(ths[j].tid == g_evs[i].rec.tid)
+				break;
+		}
+		if(j == th_num)
+		{
+			ths = (REPLAY_THREAD*)realloc(ths, (th_num + 1) * sizeof(REPLAY_THREAD));
+			memset(&ths[j], 0, sizeof(REPLAY_THREAD));
+			ths[j].tid = g_evs[i].rec.tid;
+			th_num++;
+		}
+		ths[j].ev_num++;
+		th_idx[i] = j;
+	}
+
+	for(j = 0; j < th_num; j++)
+	{
+		ths[j].evs = (long*)malloc(ths[j].ev_num * sizeof(long));
+		ths[j].ev_num = 0;
+	}
+	for(i = 0; i < g_ev_num; i++)
+	{
+		j = th_idx[i];
+		ths[j].evs[ths[j].ev_num++] = i;
+	}
+	free(th_idx);
+
+	if(!g_system)
+	{
+		g_pool = arenas == 1 ? mmpool_init() : mmpool_init_arenas(arenas);
+		mmpool_set_deferred(g_pool, deferred);
+	}
+
+	/* RSS of the trace loaded, libc and the pool initialized */
+	base_rss = rss_bytes();
+	g_peak_rss = base_rss;
+	g_sampling = 1;
+	pthread_create(&sampler, NULL, sample_func, NULL);
+
+	gettimeofday(&start, 0);
+	for(j = 0; j < th_num; j++)
+	{
+		pthread_create(&ths[j].th, NULL, replay_func, &ths[j]);
+	}
+	for(j = 0; j < th_num; j++)
+	{
+		pthread_join(ths[j].th, NULL);
+	}
+	gettimeofday(&stop, 0);
+
+	g_sampling = 0;
+	pthread_join(sampler, NULL);
+	rss = rss_bytes();
+	if(rss > g_peak_rss)
+		g_peak_rss = rss;
+
+	us = (stop.tv_sec - start.tv_sec) * 1000000 + stop.tv_usec - start.tv_usec;
+
+	printf("allocator:       %s\n", g_system ? "system" : "mmpool");
+	printf("events:          %ld in %d threads\n", g_ev_num, th_num);
+	printf("time:            %lu us\n", us);
+	printf("peak live:       %lld KB\n", g_peak_live / 1024);
+	printf("baseline rss:    %ld KB\n", base_rss / 1024);
+	printf("peak rss:        %ld KB over baseline\n", (g_peak_rss - base_rss) / 1024);
+	if(g_peak_rss > base_rss)
+		printf("fragmentation:   %.2f%% of peak rss over baseline not live\n",
+			100.0 * (1.0 - (double)g_peak_live / (g_peak_rss - base_rss)));
+	if(!g_system)
+	{
+		mmpool_dump_counter(g_pool);
+		mmpool_destroy(g_pool);
+	}
+
+	return 0;
+}
@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "mmpool.h"
+
+/*
+** Print the shared stats page published by mmpool_stats_publish, it needs
+** nothing from the process of the memory pool.
+**
+** usage: mm_stat [-p] [-i seconds] stats_file
+**	-p	print each pool as well.
+**	-i	print again every seconds until interrupted.
+*/
+
+static void print_stats(const MM_STATS_PAGE *page, int per_pool)
+{
+	const MM_POOL_STATS *stats = &page->stats;
+	int i;
+
+	printf("pid %d seq %llu updated %llu: arenas %d pools %d\n",
+		page->pid, page->seq, page->update_ts, stats->arena_num, stats->pool_num);
+	printf("   mapped %llu alloc %llu free %llu parked %llu\n",
+		stats->mapped_size, stats->alloc_size, stats->free_size, stats->parked_size);
+	printf("   free blocks %llu largest free %llu fragmentation %.2f%%\n",
+		stats->free_blocks, stats->largest_free, stats->fragmentation * 100);
+	printf("   free blocks histogram: ");
+	for(i = 0; i < MM_STATS_HIST_SIZE; i++)
+	{
+		if(stats->hist[i] > 0)
+		{
+			if(i == MM_STATS_HIST_SIZE - 1)
+				printf("[>%d]:%llu ", 32 << (i - 1), stats->hist[i]);
+			else
+				printf("[%d]:%llu ", 32 << i, stats->hist[i]);
+		}
+	}
+	printf("\n");
+	printf("   pool lock acquires %llu contended %llu wait %llu us\n",
+		stats->lock_acquires, stats->lock_contended, stats->lock_wait_ns / 1000);
+	printf("   hot classes (%llu changes): ", stats->counter[POOL_ADAPT]);
+	for(i = 0; i < MM_HOT_CLASS_NUM && stats->hot_class[i] > 0; i++)
+		printf("%u ", stats->hot_class[i]);
+	printf("\n");
+
+	if(!per_pool)
+		return;
+
+	for(i = 0; i < stats->pool_num; i++)
+	{
+		const MM_SUBPOOL_STATS *ps = &stats->pools[i];
+		printf("   [%d] arena %d size %u used %u free %u free blocks %u largest free %u\n",
+			i, ps->arena, ps->size, ps->used_size, ps->free_size,
+			ps->free_blocks, ps->largest_free);
+		printf("       lock acquires %llu contended %llu wait %llu us\n",
+			ps->lock_acquires, ps->lock_contended, ps->lock_wait_ns / 1000);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static MM_STATS_PAGE page;
+	int opt, per_pool = 0, interval = 0;
+
+	while((opt = getopt(argc, argv, "pi:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'p':
+			per_pool = 1;
+			break;
+		case 'i':
+			interval = atoi(optarg);
+			break;
+		default:
+			printf("usage: %s [-p] [-i seconds] stats_file\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(optind >= argc)
+	{
+		printf("usage: %s [-p] [-i seconds] stats_file\n", argv[0]);
+		return 1;
+	}
+
+	do
+	{
+		if(mmpool_stats_read(argv[optind], &page) != 0)
+		{
+			printf("read stats %s failed.\n", argv[optind]);
+			return 1;
+		}
+		print_stats(&page, per_pool);
+
+		if(interval > 0)
+			sleep(interval);
+	}while(interval > 0);
+
+	return 0;
+}
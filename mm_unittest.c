@@ -1,50 +1,51 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <pthread.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <sys/time.h>
 
 #include "mmpool.h"
+#include "mmtrace.h"
+#include "mmbufpool.h"
 
 #define TH_NUM 200
 //#define M_ARENA 4
-MM_POOL *g_static_pool[4];
+MM_POOL *g_static_pool;
 int g_ppid[TH_NUM] = {0};
 
-int pidtoidx(int pid)
-{
-#ifdef M_ARENA
-	if(pid < 12)
-		return 0;
-	else if(pid < 24)
-		return 1;
-	else if(pid < 36)
-		return 2;
-	else
-		return 3;
-#else
-	return 0;
-#endif
-}
-
-
 #define IDX 10000
 #define S_IDX 1
 
 #ifdef GLIBC
 MM_POOL* mmpool_init() {return NULL;}
+#define mmpool_init_arenas(a) NULL
 #define mmpool_destroy(a)
 #define mmpool_dump(a)
 #define mmpool_dump_counter(a)
 #define mmpool_malloc(a, b) malloc(b)
+#define mmpool_aligned_alloc(a, b, c) aligned_alloc(b, c)
+#define mmpool_calloc(a, b, c) calloc(b, c)
 #define mmpool_free(a) free(a)
+#define mmpool_set_deferred(a, b)
+#define mmpool_set_adaptive(a, b, c)
+#define mmpool_epoch_enter()
+#define mmpool_epoch_exit()
+#define mmpool_retire(a) free(a)
+#define mmpool_epoch_barrier()
+#define mmpool_provision_start(a, b, c) 0
+#define mmpool_set_guard(a, b, c) 0
+#define mmtrace_start(a) 0
+#define mmtrace_stop()
 #endif
 
 void *p_malloc_func(void *arg)
 {
 	int ppid = *(int*)arg;
-	int idx, size;
+	int idx, size, align;
 	unsigned char *addr[IDX];
 
 	printf("thread %d starting...\n", ppid);
@@ -54,7 +55,7 @@ void *p_malloc_func(void *arg)
 	for(idx = S_IDX; idx < IDX; idx++)
 	{
 		size = rand() % IDX;
-		addr[idx] = mmpool_malloc(g_static_pool[pidtoidx(ppid)], size);
+		addr[idx] = mmpool_malloc(g_static_pool, size);
 		memset(addr[idx], 0, size);
 	}
 	usleep(500);
@@ -68,7 +69,7 @@ void *p_malloc_func(void *arg)
 	/* allocte fixed size in loop 10000 */
 	for(idx = S_IDX; idx < IDX; idx++)
 	{
-		addr[idx] = mmpool_malloc(g_static_pool[pidtoidx(ppid)], 128);
+		addr[idx] = mmpool_malloc(g_static_pool, 128);
 		memset(addr[idx], 0, 128);
 	}
 	usleep(500);
@@ -79,10 +80,66 @@ void *p_malloc_func(void *arg)
         }
         usleep(500);
 
+	/* allocate cache line and page aligned object in loop 100 */
+	for(idx = S_IDX; idx < 100; idx++)
+	{
+		align = (idx % 2) ? 64 : 4096;
+		addr[idx] = mmpool_aligned_alloc(g_static_pool, align, idx * 32);
+		if((unsigned long)addr[idx] & (align - 1))
+			printf("***** Address [%p] is not aligned to %d.*****\n", addr[idx], align);
+		memset(addr[idx], 0, idx * 32);
+	}
+	usleep(500);
+
+	for(idx = S_IDX; idx < 100; idx++)
+	{
+		mmpool_free(addr[idx]);
+	}
+	usleep(500);
+
+	/* retire fixed size object in epoch sections in loop 10000 */
+	for(idx = S_IDX; idx < IDX; idx++)
+	{
+		addr[idx] = mmpool_malloc(g_static_pool, 64);
+		memset(addr[idx], 0, 64);
+	}
+	usleep(500);
+
+	for(idx = S_IDX; idx < IDX; idx++)
+	{
+		mmpool_epoch_enter();
+		mmpool_retire(addr[idx]);
+		mmpool_epoch_exit();
+	}
+	usleep(500);
+
+	/* allocate zeroed random size in loop 10000, reused memory included */
+	for(idx = S_IDX; idx < IDX; idx++)
+	{
+		size = rand() % IDX;
+		addr[idx] = mmpool_calloc(g_static_pool, 1, size);
+		for(align = 0; align < size; align++)
+		{
+			if(addr[idx][align] != 0)
+			{
+				printf("***** Address [%p] is not zeroed at %d.*****\n", addr[idx], align);
+				break;
+			}
+		}
+		memset(addr[idx], 0xa5, size);
+	}
+	usleep(500);
+
+	for(idx = S_IDX; idx < IDX; idx++)
+	{
+		mmpool_free(addr[idx]);
+	}
+	usleep(500);
+
         /* allocate large object in loop 100 */
         for(idx = 2000; idx < 2100; idx++)
         {
-                addr[idx] = mmpool_malloc(g_static_pool[pidtoidx(ppid)], idx * 1024);
+                addr[idx] = mmpool_malloc(g_static_pool, idx * 1024);
                 memset(addr[idx], 0, idx * 1024);
         }
         usleep(500);
@@ -97,7 +154,7 @@ void *p_malloc_func(void *arg)
         for(idx = S_IDX; idx < IDX; idx++)
         {   
                 size = rand() % IDX;
-                addr[idx] = mmpool_malloc(g_static_pool[pidtoidx(ppid)], size);
+                addr[idx] = mmpool_malloc(g_static_pool, size);
                 memset(addr[idx], 0, size);
         }
         usleep(500);
@@ -113,9 +170,77 @@ void *p_malloc_func(void *arg)
 }
 
 
+#ifndef GLIBC
+/* O_DIRECT write and read back with pinned buffers, skipped if not supported */
+void bufpool_test(void)
+{
+	MM_BUFPOOL *bp;
+	struct iovec iov[4];
+	unsigned char *wbuf, *rbuf, *other;
+	const char *path = "mm_test_direct.tmp";
+	int fd, num;
+
+	bp = mmpool_bufpool_create(g_static_pool, 8192, 64);
+	if(bp == NULL)
+	{
+		printf("***** Buffer pool creation failed.*****\n");
+		return;
+	}
+
+	num = mmpool_bufpool_iovec(bp, iov, 4, 0);
+	wbuf = mmpool_bufpool_get(bp);
+	rbuf = mmpool_bufpool_get(bp);
+	if(((unsigned long)wbuf | (unsigned long)rbuf) & (getpagesize() - 1))
+		printf("***** Buffer [%p] [%p] is not page aligned.*****\n", wbuf, rbuf);
+
+	fd = open(path, O_CREAT | O_TRUNC | O_RDWR | O_DIRECT, 0644);
+	if(fd < 0)
+	{
+		if(errno == EINVAL)
+			printf("buffer pool O_DIRECT test skipped, not supported.\n");
+		else
+			printf("***** Buffer pool test file open failed, errno %d.*****\n", errno);
+	}
+	else
+	{
+		memset(wbuf, 0x5a, 8192);
+		memset(rbuf, 0, 8192);
+		if(pwrite(fd, wbuf, 8192, 0) != 8192 || pread(fd, rbuf, 8192, 0) != 8192)
+		{
+			if(errno == EINVAL)
+				printf("buffer pool O_DIRECT test skipped, not supported.\n");
+			else
+				printf("***** Buffer pool O_DIRECT I/O failed, errno %d.*****\n", errno);
+		}
+		else if(memcmp(wbuf, rbuf, 8192) != 0)
+			printf("***** Buffer pool O_DIRECT read back mismatch.*****\n");
+		else
+			printf("buffer pool O_DIRECT test passed, %d regions.\n", num);
+		close(fd);
+		unlink(path);
+	}
+
+	/* a double put while another buffer is out must not hand it out twice */
+	mmpool_bufpool_put(bp, wbuf);
+	mmpool_bufpool_put(bp, wbuf);
+	wbuf = mmpool_bufpool_get(bp);
+	other = mmpool_bufpool_get(bp);
+	if(wbuf == other)
+		printf("***** Buffer [%p] handed out twice after a double put.*****\n", wbuf);
+	else
+		printf("buffer pool double put test passed.\n");
+
+	mmpool_bufpool_put(bp, other);
+	mmpool_bufpool_put(bp, wbuf);
+	mmpool_bufpool_put(bp, rbuf);
+	mmpool_bufpool_destroy(bp);
+}
+#endif
+
 int main(int argc, char *argv[])
 {
-	int idx, th_num = 1;
+	int idx, th_num = 1, deferred = 0, spare = 0, guard = 0, adaptive = 0;
+	const char *trace = NULL;
 	pthread_t th[TH_NUM];
 	struct timeval start, stop;
 	unsigned long us;
@@ -124,14 +249,47 @@ int main(int argc, char *argv[])
 	{
 		th_num =  atoi(argv[1]);
 	}
+	if(argc > 2)
+	{
+		/* size limit of deferred coalescing per pool */
+		deferred = atoi(argv[2]);
+	}
+	if(argc > 3)
+	{
+		/* spare pools kept by the provisioner, prefaulted */
+		spare = atoi(argv[3]);
+	}
+	if(argc > 4)
+	{
+		/* sample rate of guard page allocations */
+		guard = atoi(argv[4]);
+	}
+	if(argc > 5)
+	{
+		/* record allocations to trace file for mm_replay */
+		trace = argv[5];
+	}
+	if(argc > 6)
+	{
+		/* parking limit of adaptive hot classes, prewarmed by a quarter */
+		adaptive = atoi(argv[6]);
+	}
 	
 	gettimeofday(&start, 0);
-	g_static_pool[0] = mmpool_init();
 #ifdef M_ARENA
-	g_static_pool[1] = mmpool_init();
-	g_static_pool[2] = mmpool_init();
-	g_static_pool[3] = mmpool_init();
+	g_static_pool = mmpool_init_arenas(M_ARENA);
+#else
+	g_static_pool = mmpool_init();
 #endif
+	mmpool_set_deferred(g_static_pool, deferred);
+	if(adaptive > 0)
+		mmpool_set_adaptive(g_static_pool, adaptive, adaptive / 4);
+	if(spare > 0)
+		mmpool_provision_start(g_static_pool, spare, 1);
+	if(guard > 0)
+		mmpool_set_guard(g_static_pool, guard, 1024);
+	if(trace != NULL)
+		mmtrace_start(trace);
 
 	for(idx = 0; idx < th_num; idx++)
 	{
@@ -146,29 +304,35 @@ int main(int argc, char *argv[])
 		pthread_join(th[idx], NULL);
 	}
 
+	/* free the objects retired but not reclaimed yet */
+	mmpool_epoch_barrier();
+
+	if(trace != NULL)
+		mmtrace_stop();
+
 	gettimeofday(&stop, 0);
 	us = stop.tv_usec - start.tv_usec;
 	us += (stop.tv_sec - start.tv_sec) * 5000000;
 	printf("used time: %lu ms.\n", us/5000);
 
 #ifndef GLIBC
+	bufpool_test();
 	//mmpool_dump(g_static_pool);
-	mmpool_dump_counter(g_static_pool[0]);
-#ifdef M_ARENA
-	mmpool_dump_counter(g_static_pool[1]);
-	mmpool_dump_counter(g_static_pool[2]);
-	mmpool_dump_counter(g_static_pool[3]);
-#endif
+	mmpool_dump_counter(g_static_pool);
+	{
+		static MM_POOL_STATS stats;
+		mmpool_get_stats(g_static_pool, &stats);
+		printf("pools: %d mapped: %llu alloc: %llu free blocks: %llu largest free: %llu fragmentation: %.2f%%\n",
+			stats.pool_num, stats.mapped_size, stats.alloc_size, stats.free_blocks,
+			stats.largest_free, stats.fragmentation * 100);
+		printf("hot classes: %u %u %u %u, changes: %llu\n", stats.hot_class[0], stats.hot_class[1],
+			stats.hot_class[2], stats.hot_class[3], stats.counter[POOL_ADAPT]);
+	}
 #else
 	malloc_stats();
 #endif
 
-	mmpool_destroy(g_static_pool[0]);
-#ifdef M_ARENA
-	mmpool_destroy(g_static_pool[1]);
-	mmpool_destroy(g_static_pool[2]);
-	mmpool_destroy(g_static_pool[3]);
-#endif
+	mmpool_destroy(g_static_pool);
 
 	return 0;
 }
@@ -0,0 +1,230 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "mmpool.h"
+#include "mmbufpool.h"
+
+/*
+** Buffers are numbered in order of the regions, a region holds buf_per_region
+** buffers but the last one. The free buffers are kept in a stack of indexes,
+** and a flag per buffer tells the ones handed out, to catch a double put.
+*/
+typedef struct mm_bufpool_region
+{
+	unsigned char *addr;		/* page aligned start of the region */
+	unsigned int size;		/* size of the region, locked in memory */
+}MM_BUFPOOL_REGION;
+
+struct mm_bufpool
+{
+	MM_POOL *pool;			/* memory pool the regions are from */
+	unsigned int buf_size;		/* size of a buffer, multiple of page size */
+	unsigned int buf_num;		/* number of buffers */
+	unsigned int buf_per_region;	/* buffers of a full region */
+	int region_num;			/* number of regions */
+	MM_BUFPOOL_REGION regions[MM_BUFPOOL_MAX_REGION];
+	MM_LOCK lock;			/* protect the free stack */
+	unsigned int free_len;		/* number of free buffers */
+	unsigned int *free_stack;	/* indexes of free buffers */
+	unsigned char *in_use;		/* 1 for a buffer handed out, with lock */
+};
+
+static void bufpool_release(MM_BUFPOOL *bp)
+{
+	int i;
+
+	for(i = 0; i < bp->region_num; i++)
+	{
+		munlock(bp->regions[i].addr, bp->regions[i].size);
+		mmpool_free(bp->regions[i].addr);
+	}
+	mmpool_lock_destroy(&bp->lock);
+	free(bp->free_stack);
+	free(bp->in_use);
+	free(bp);
+}
+
+MM_BUFPOOL *mmpool_bufpool_create(MM_POOL *pool, unsigned int buf_size, unsigned int buf_num)
+{
+	MM_BUFPOOL *bp;
+	unsigned int pgsize = getpagesize();
+	unsigned int left, num, i;
+
+	if(buf_size == 0 || buf_num == 0)
+		return NULL;
+
+	buf_size = ((buf_size + pgsize - 1) / pgsize) * pgsize;
+	if(buf_size > MM_BUFPOOL_REGION_SIZE)
+	{
+		printf("memory pool buffer size %u is over region size.\n", buf_size);
+		return NULL;
+	}
+
+	bp = (MM_BUFPOOL*)malloc(sizeof(MM_BUFPOOL));
+	if(bp == NULL)
+		return NULL;
+	memset(bp, 0, sizeof(MM_BUFPOOL));
+	bp->pool = pool;
+	bp->buf_size = buf_size;
+	bp->buf_num = buf_num;
+	bp->buf_per_region = MM_BUFPOOL_REGION_SIZE / buf_size;
+	mmpool_lock_init(&bp->lock);
+
+	if((buf_num + bp->buf_per_region - 1) / bp->buf_per_region > MM_BUFPOOL_MAX_REGION)
+	{
+		printf("memory pool buffer pool of %u buffers is over max regions.\n", buf_num);
+		bufpool_release(bp);
+		return NULL;
+	}
+
+	bp->free_stack = (unsigned int*)malloc(buf_num * sizeof(unsigned int));
+	bp->in_use = (unsigned char*)calloc(buf_num, sizeof(unsigned char));
+	if(bp->free_stack == NULL || bp->in_use == NULL)
+	{
+		bufpool_release(bp);
+		return NULL;
+	}
+
+	for(left = buf_num; left > 0; left -= num)
+	{
+		MM_BUFPOOL_REGION *region = &bp->regions[bp->region_num];
+
+		num = left < bp->buf_per_region ? left : bp->buf_per_region;
+		region->size = num * buf_size;
+		region->addr = (unsigned char*)mmpool_aligned_alloc(pool, pgsize, region->size);
+		if(region->addr == NULL)
+		{
+			printf("memory pool buffer region of %u bytes allocation failed.\n", region->size);
+			bufpool_release(bp);
+			return NULL;
+		}
+
+		/* fault in and pin the pages, the pool pages could be swapped out */
+		if(mlock(region->addr, region->size) != 0)
+		{
+			printf("memory pool buffer region mlock failed, errno %d.\n", errno);
+			mmpool_free(region->addr);
+			bufpool_release(bp);
+			return NULL;
+		}
+		bp->region_num++;
+	}
+
+	/* the lower buffers on top, so they are used first */
+	for(i = 0; i < buf_num; i++)
+		bp->free_stack[i] = buf_num - 1 - i;
+	bp->free_len = buf_num;
+
+	return bp;
+}
+
+void mmpool_bufpool_destroy(MM_BUFPOOL *bp)
+{
+	if(bp == NULL)
+		return;
+
+	if(bp->free_len != bp->buf_num)
+		printf("memory pool buffer pool destroyed with %u buffers in use.\n",
+			bp->buf_num - bp->free_len);
+	bufpool_release(bp);
+}
+
+static void *bufpool_addr(MM_BUFPOOL *bp, unsigned int idx)
+{
+	return bp->regions[idx / bp->buf_per_region].addr
+		+ (size_t)(idx % bp->buf_per_region) * bp->buf_size;
+}
+
+void *mmpool_bufpool_get(MM_BUFPOOL *bp)
+{
+	unsigned int idx;
+
+	mmpool_lock_acquire(&bp->lock);
+	if(bp->free_len == 0)
+	{
+		mmpool_lock_release(&bp->lock);
+		return NULL;
+	}
+	idx = bp->free_stack[--bp->free_len];
+	bp->in_use[idx] = 1;
+	mmpool_lock_release(&bp->lock);
+
+	return bufpool_addr(bp, idx);
+}
+
+int mmpool_bufpool_index(MM_BUFPOOL *bp, const void *buf)
+{
+	uintptr_t addr = (uintptr_t)buf;
+	int i;
+
+	for(i = 0; i < bp->region_num; i++)
+	{
+		uintptr_t start = (uintptr_t)bp->regions[i].addr;
+
+		if(addr >= start && addr < start + bp->regions[i].size)
+		{
+			if((addr - start) % bp->buf_size != 0)
+				return -1;
+			return i * bp->buf_per_region + (int)((addr - start) / bp->buf_size);
+		}
+	}
+
+	return -1;
+}
+
+void mmpool_bufpool_put(MM_BUFPOOL *bp, void *buf)
+{
+	int idx;
+
+	if(buf == NULL)
+		return;
+
+	idx = mmpool_bufpool_index(bp, buf);
+	if(idx < 0)
+	{
+		printf("***** Address [%p] is not a buffer of the buffer pool.*****\n", buf);
+		return;
+	}
+
+	mmpool_lock_acquire(&bp->lock);
+	if(!bp->in_use[idx])
+	{
+		mmpool_lock_release(&bp->lock);
+		printf("***** Buffer [%p] has already been put back, double put.*****\n", buf);
+		return;
+	}
+	bp->in_use[idx] = 0;
+	bp->free_stack[bp->free_len++] = (unsigned int)idx;
+	mmpool_lock_release(&bp->lock);
+}
+
+int mmpool_bufpool_iovec(MM_BUFPOOL *bp, struct iovec *iov, int iov_num, int per_buf)
+{
+	int num = per_buf ? (int)bp->buf_num : bp->region_num;
+	int i;
+
+	if(iov == NULL)
+		return num;
+	if(iov_num < num)
+		return -1;
+
+	for(i = 0; i < num; i++)
+	{
+		if(per_buf)
+		{
+			iov[i].iov_base = bufpool_addr(bp, i);
+			iov[i].iov_len = bp->buf_size;
+		}
+		else
+		{
+			iov[i].iov_base = bp->regions[i].addr;
+			iov[i].iov_len = bp->regions[i].size;
+		}
+	}
+
+	return num;
+}
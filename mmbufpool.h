@@ -0,0 +1,129 @@
+#ifndef _MMBUFPOOL_H
+#define _MMBUFPOOL_H
+
+#include <sys/uio.h>
+#include "mmpool.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Pinned I/O buffer pool on top of a memory pool, for O_DIRECT and fixed
+** buffers of io_uring. Buffers are of a fixed size, multiple of the page
+** size and page aligned. They are carved from a few large regions, each
+** one allocated from the memory pool page aligned and locked in memory.
+*/
+#define MM_BUFPOOL_REGION_SIZE (16 * 1024 * 1024) /* max size of a region */
+#define MM_BUFPOOL_MAX_REGION 64		/* max regions of a buffer pool */
+
+typedef struct mm_bufpool MM_BUFPOOL;
+
+/*
+** MMPOOL_BUFPOOL_CREATE
+** Purpose:
+**      Create a buffer pool of buf_num buffers from the memory pool, all
+**	regions are allocated and locked in memory at creation.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	unsigned int buf_size
+**		size of a buffer, rounded up to a multiple of the page size.
+**	unsigned int buf_num
+**		number of buffers.
+**
+** Returns:
+**      The buffer pool, NULL for failure, e.g. mlock over RLIMIT_MEMLOCK.
+*/
+MM_BUFPOOL *mmpool_bufpool_create(MM_POOL *pool, unsigned int buf_size, unsigned int buf_num);
+
+/*
+** MMPOOL_BUFPOOL_DESTROY
+** Purpose:
+**      Unlock and free all regions of the buffer pool back to the memory
+**	pool, the buffers must not be in use by any I/O.
+**
+** Parameters:
+**      MM_BUFPOOL *bp
+**              the buffer pool.
+**
+** Returns:
+**      None
+*/
+void mmpool_bufpool_destroy(MM_BUFPOOL *bp);
+
+/*
+** MMPOOL_BUFPOOL_GET
+** Purpose:
+**      Get a free buffer from the buffer pool.
+**
+** Parameters:
+**      MM_BUFPOOL *bp
+**              the buffer pool.
+**
+** Returns:
+**      The page aligned buffer, NULL if all buffers are in use.
+*/
+void *mmpool_bufpool_get(MM_BUFPOOL *bp);
+
+/*
+** MMPOOL_BUFPOOL_PUT
+** Purpose:
+**      Return a buffer to the buffer pool.
+**
+** Parameters:
+**      MM_BUFPOOL *bp
+**              the buffer pool.
+**	void *buf
+**		the buffer returned by mmpool_bufpool_get.
+**
+** Returns:
+**      None
+*/
+void mmpool_bufpool_put(MM_BUFPOOL *bp, void *buf);
+
+/*
+** MMPOOL_BUFPOOL_INDEX
+** Purpose:
+**      Get the index of a buffer in the buffer pool, which is also the
+**	index of the buffer in the iovec list exported with one iovec per
+**	buffer, e.g. buf_index of io_uring fixed buffers.
+**
+** Parameters:
+**      MM_BUFPOOL *bp
+**              the buffer pool.
+**	const void *buf
+**		the buffer returned by mmpool_bufpool_get.
+**
+** Returns:
+**      The index of the buffer, -1 if it is not a buffer of the pool.
+*/
+int mmpool_bufpool_index(MM_BUFPOOL *bp, const void *buf);
+
+/*
+** MMPOOL_BUFPOOL_IOVEC
+** Purpose:
+**      Export the buffer pool as an iovec list, for registration of fixed
+**	buffers, e.g. io_uring_register_buffers.
+**
+** Parameters:
+**      MM_BUFPOOL *bp
+**              the buffer pool.
+**	struct iovec *iov
+**		the iovec list filled, NULL to get the number only.
+**	int iov_num
+**		capacity of iov.
+**	int per_buf
+**		1 for one iovec per buffer, 0 for one iovec per region.
+**
+** Returns:
+**      Number of iovecs of the list, -1 if iov_num is not enough.
+*/
+int mmpool_bufpool_iovec(MM_BUFPOOL *bp, struct iovec *iov, int iov_num, int per_buf);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
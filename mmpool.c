@@ -1,14 +1,29 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
+#include <limits.h>
 #include <errno.h>
 #include <assert.h>
+#include <sched.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "mmpool.h"
+#include "mmtrace.h"
 
 #define DEFAULT_PAGE_SIZE 4096 /* 4k */
+#ifndef DEFAULT_PAGE_COUNT
 #define DEFAULT_PAGE_COUNT 16384 /* 64MB*/
+#endif
 
 static unsigned int pgsize = DEFAULT_PAGE_SIZE;
 
@@ -38,6 +53,128 @@ typedef unsigned char BYTE;
 #define DEC_POOL_FREEBLOCKS(pool, mmb) ((pool)->free_blocks[SIZE_TO_INDEX((mmb)->size)]--)
 #define POOL_COUNTER(pool, idx) ((pool)->main_pool->meta->counter[(idx)])
 
+/* parked blocks are linked through their data area, they are not used anyway */
+#define QUICK_NEXT(mmb) (*(MM_BLOCK**)MMBLOCK_TO_ADDR(mmb))
+
+/*
+** Pool locks. The critical sections of a pool are short, so the adaptive
+** lock spins first, up to twice the average spins it took recently, and
+** parks on the futex only when the holder seems to stay long. The state
+** protocol is the one of the futex paper: 0 free, 1 locked, 2 contended.
+*/
+#define MM_LOCK_SPIN_MIN 16
+#define MM_LOCK_SPIN_MAX 1024
+
+#if defined(__x86_64__) || defined(__i386__)
+#define MM_CPU_RELAX() __builtin_ia32_pause()
+#else
+#define MM_CPU_RELAX() __sync_synchronize()
+#endif
+
+static int g_lock_spin_max = -1;	/* no spinning on a single CPU */
+
+static unsigned long long lock_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void mmpool_lock_init(MM_LOCK *lock)
+{
+	memset(lock, 0, sizeof(MM_LOCK));
+	if(g_lock_spin_max < 0)
+		g_lock_spin_max = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? MM_LOCK_SPIN_MAX : 0;
+#ifdef MM_LOCK_PTHREAD
+	pthread_mutex_init(&lock->impl.mutex, NULL);
+#endif
+}
+
+void mmpool_lock_destroy(MM_LOCK *lock)
+{
+#ifdef MM_LOCK_PTHREAD
+	pthread_mutex_destroy(&lock->impl.mutex);
+#else
+	(void)lock;			/* nothing to release of a futex */
+#endif
+}
+
+#ifdef MM_LOCK_PTHREAD
+void mmpool_lock_acquire(MM_LOCK *lock)
+{
+	unsigned long long start;
+
+	if(pthread_mutex_trylock(&lock->impl.mutex) == 0)
+	{
+		lock->acquires++;
+		return;
+	}
+
+	start = lock_now_ns();
+	pthread_mutex_lock(&lock->impl.mutex);
+	lock->acquires++;
+	lock->contended++;
+	lock->wait_ns += lock_now_ns() - start;
+}
+
+void mmpool_lock_release(MM_LOCK *lock)
+{
+	pthread_mutex_unlock(&lock->impl.mutex);
+}
+#else
+void mmpool_lock_acquire(MM_LOCK *lock)
+{
+	unsigned long long start;
+	int n, max, c;
+
+	if(__sync_bool_compare_and_swap(&lock->impl.futex.state, 0, 1))
+	{
+		lock->acquires++;
+		return;
+	}
+
+	start = lock_now_ns();
+	max = lock->impl.futex.spin * 2 + MM_LOCK_SPIN_MIN;
+	if(max > g_lock_spin_max)
+		max = g_lock_spin_max;
+
+	for(n = 0; n < max; n++)
+	{
+		MM_CPU_RELAX();
+		if(lock->impl.futex.state == 0 && __sync_bool_compare_and_swap(&lock->impl.futex.state, 0, 1))
+			break;
+	}
+
+	if(n == max)
+	{
+		/* park, whoever takes it over 2 wakes up the next one at release */
+		c = __sync_lock_test_and_set(&lock->impl.futex.state, 2);
+		while(c != 0)
+		{
+			syscall(SYS_futex, &lock->impl.futex.state, FUTEX_WAIT_PRIVATE, 2, NULL, NULL, 0);
+			c = __sync_lock_test_and_set(&lock->impl.futex.state, 2);
+		}
+	}
+
+	/* moving average of the spins needed, a park counts as the max */
+	lock->impl.futex.spin += (n - lock->impl.futex.spin) / 8;
+	lock->acquires++;
+	lock->contended++;
+	lock->wait_ns += lock_now_ns() - start;
+}
+
+void mmpool_lock_release(MM_LOCK *lock)
+{
+	if(__sync_fetch_and_sub(&lock->impl.futex.state, 1) != 1)
+	{
+		/* there may be waiters parked */
+		__sync_lock_release(&lock->impl.futex.state);
+		syscall(SYS_futex, &lock->impl.futex.state, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+	}
+}
+#endif
+
 static int IS_ADDR_IN_POOL(const MM_POOL *pool, const void *addr)
 {
 	uintptr_t p_addr = (uintptr_t)pool->m_addr;
@@ -82,10 +219,30 @@ void mmpool_ins_freelist(MM_POOL *pool, MM_BLOCK *mmb, MMB_LLE *mmb_lle)
 
 		pool->free_blocks_list[index]->tail = mmb_lle;
 	}
+
+	if(index == FREEMMB_BUCKET_SIZE-1 && mmb->size > pool->large_max)
+	{
+		pool->large_max = mmb->size;
+	}
+}
+
+/* Walk the large bucket to find the largest free block, the pool lock must be held. */
+static void pool_update_large_max(MM_POOL *pool)
+{
+	MMB_LLE *p;
+	unsigned int max = 0;
+
+	for(p = pool->free_blocks_list[FREEMMB_BUCKET_SIZE-1]; p; p = p->next)
+	{
+		if(p->mmb->size > max)
+			max = p->mmb->size;
+	}
+	pool->large_max = max;
 }
 
 MMB_LLE *mmpool_del_freelist(MM_POOL *pool, MM_BLOCK *mmb)
 {
+	MMB_LLE *found = NULL;
 	int index;
 	index = SIZE_TO_INDEX(mmb->size);
 
@@ -102,7 +259,7 @@ MMB_LLE *mmpool_del_freelist(MM_POOL *pool, MM_BLOCK *mmb)
 			{
 				pool->free_blocks_list[index]->tail = mmb_lle->tail;
 			}
-			return mmb_lle;
+			found = mmb_lle;
 		}
 		else if(mmb_lle->tail->mmb == mmb)
 		{
@@ -112,7 +269,7 @@ MMB_LLE *mmpool_del_freelist(MM_POOL *pool, MM_BLOCK *mmb)
 			tail = mmb_lle->tail;
 			pool->free_blocks_list[index]->tail = tail->prev;
 			tail->prev->next = NULL;
-			return tail;
+			found = tail;
 		}
 		else
 		{
@@ -128,14 +285,383 @@ MMB_LLE *mmpool_del_freelist(MM_POOL *pool, MM_BLOCK *mmb)
 				p->prev->next = p->next;
 				p->next->prev = p->prev;
 
-				return p;
+				found = p;
 			}
 		}
 	}
 
+	if(found != NULL && index == FREEMMB_BUCKET_SIZE-1 && mmb->size >= pool->large_max)
+	{
+		pool_update_large_max(pool);
+	}
+
+	return found;
+}
+
+/*
+** Map a new pool which could hold a free block of size at least, the pool
+** is not added to the pool_array of main pool yet. With prefault, all the
+** pages are populated at mapping, so the first touch does not fault.
+*/
+static MM_POOL *pool_new(MM_POOL *g_pool, unsigned int size, int prefault)
+{
+	MM_POOL *new_pool;
+	MM_BLOCK *mmb;
+
+	new_pool = (MM_POOL*)malloc(sizeof(MM_POOL));
+	memset(new_pool, 0, sizeof(MM_POOL));
+
+	if(size > (pgsize * DEFAULT_PAGE_COUNT - MM_BLOCK_HEAD_SIZE))
+	{
+		new_pool->size = ((size + pgsize + MM_BLOCK_HEAD_SIZE) / pgsize) * pgsize;
+	}
+	else
+	{
+		new_pool->size = pgsize * DEFAULT_PAGE_COUNT;
+	}
+
+	new_pool->m_addr = mmap (0, new_pool->size, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | (prefault ? MAP_POPULATE : 0), -1, 0);
+	if(new_pool->m_addr == MAP_FAILED)
+	{
+		printf("memory pool mmap failed for size %u, errno %d.\n", new_pool->size, errno);
+		free(new_pool);
+		return NULL;
+	}
+
+	mmpool_lock_init(&new_pool->m_lock);
+	new_pool->free_size = new_pool->size;
+	new_pool->main_pool = g_pool;
+
+        mmb = POOL_FIRST_MMBLOCK(new_pool);
+        mmb->size = new_pool->size - MM_BLOCK_HEAD_SIZE;
+        mmb->flags = 0;
+        mmb->dirty = 0;		/* fresh anonymous mapping is zero */
+        mmb->pool = new_pool;
+	mmb->prev = NULL;
+
+	mmpool_ins_freelist(new_pool, mmb, NULL);
+	INC_POOL_FREEBLOCKS(new_pool, mmb);
+
+	return new_pool;
+}
+
+/* Unmap a pool other than the main pool and release its free blocks list. */
+static void pool_release(MM_POOL *pool)
+{
+	MMB_LLE *mmb_lle, *p;
+	int j;
+
+	munmap(pool->m_addr, pool->size);
+
+	for(j = 0; j < FREEMMB_BUCKET_SIZE; j++)
+	{
+		mmb_lle = pool->free_blocks_list[j];
+		while(mmb_lle)
+		{
+			p = mmb_lle;
+			mmb_lle = p->next;
+			free(p);
+			ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, BLK_LIST_DEL));
+		}
+	}
+	mmpool_lock_destroy(&pool->m_lock);
+	free(pool);
+}
+
+/*
+** Sampled guard page allocations. About one of rate allocations which fit
+** in a page is served from the guard area instead of the pool. Each slot
+** of the area is a data page followed by a PROT_NONE guard page, and the
+** block is placed at the end of the data page, so an overrun faults on the
+** guard page at once. A freed slot is made PROT_NONE as well and queued
+** at the tail of the free slots, it stays inaccessible until all other
+** slots have been used, which catches the use after free.
+*/
+typedef struct mm_guard
+{
+	struct mm_guard *next;		/* all guard areas for free and fault lookup */
+	MM_POOL *main_pool;		/* main pool the area belongs to */
+	BYTE *m_addr;			/* start address of the slots */
+	unsigned int slot_num;		/* number of slots */
+	unsigned int slot_size;		/* data page and guard page */
+	unsigned int rate;		/* sample one of rate allocations, 0 for none */
+	unsigned int *alloc_size;	/* size allocated of each slot, 0 if free */
+	unsigned char *freed;		/* 1 if the slot has ever been freed */
+	unsigned int *free_slots;	/* ring of free slots, oldest freed first */
+	unsigned int free_head;		/* ring index of next slot to allocate */
+	unsigned int free_len;		/* number of free slots */
+	pthread_mutex_t lock;		/* protect the slots */
+}MM_GUARD;
+
+static MM_GUARD *g_guard_list = NULL;
+static pthread_mutex_t g_guard_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction g_guard_old_action;
+static __thread int guard_countdown = 0;
+static __thread unsigned int guard_seed = 0;
+
+#define GUARD_SLOT_ADDR(guard, slot) ((guard)->m_addr + (size_t)(slot) * (guard)->slot_size)
+
+static MM_GUARD *guard_find(const void *addr)
+{
+	MM_GUARD *guard;
+	uintptr_t u_addr = (uintptr_t)addr;
+
+	for(guard = g_guard_list; guard != NULL; guard = guard->next)
+	{
+		uintptr_t g_addr = (uintptr_t)guard->m_addr;
+		if(u_addr >= g_addr && u_addr < g_addr + (size_t)guard->slot_num * guard->slot_size)
+			return guard;
+	}
+
 	return NULL;
 }
 
+static void guard_report(const char *what, MM_GUARD *guard, const void *addr)
+{
+	char buf[256];
+	unsigned int slot;
+	BYTE *data;
+	int len;
+
+	slot = (unsigned int)(((BYTE*)addr - guard->m_addr) / guard->slot_size);
+	data = GUARD_SLOT_ADDR(guard, slot) + pgsize - guard->alloc_size[slot];
+	len = snprintf(buf, sizeof(buf), "***** mmpool %s at [%p], slot %u block [%p] size %u, offset %ld.*****\n",
+			what, addr, slot, data, guard->alloc_size[slot], (long)((BYTE*)addr - data));
+	if(len > 0)
+		write(STDERR_FILENO, buf, len);
+}
+
+static void guard_fault_handler(int sig, siginfo_t *info, void *ctx)
+{
+	MM_GUARD *guard;
+
+	guard = guard_find(info->si_addr);
+	if(guard != NULL)
+	{
+		unsigned int slot, offset;
+
+		slot = (unsigned int)(((BYTE*)info->si_addr - guard->m_addr) / guard->slot_size);
+		offset = (unsigned int)(((BYTE*)info->si_addr - guard->m_addr) % guard->slot_size);
+		if(offset >= pgsize)
+			guard_report("heap buffer overflow", guard, info->si_addr);
+		else if(guard->alloc_size[slot] == 0 && guard->freed[slot])
+			write(STDERR_FILENO, "***** mmpool use after free of a sampled block.*****\n", 53);
+		else if(guard->alloc_size[slot] == 0)
+			write(STDERR_FILENO, "***** mmpool wild access to an unused guard slot.*****\n", 55);
+		else
+			guard_report("invalid access", guard, info->si_addr);
+	}
+
+	/* fall back to the previous action, the fault happens again with it */
+	sigaction(SIGSEGV, &g_guard_old_action, NULL);
+	(void)sig;
+	(void)ctx;
+}
+
+static MM_GUARD *guard_new(MM_POOL *g_pool, unsigned int rate, unsigned int slot_num)
+{
+	static int handler_installed = 0;
+	MM_GUARD *guard;
+	unsigned int i;
+
+	guard = (MM_GUARD*)malloc(sizeof(MM_GUARD));
+	memset(guard, 0, sizeof(MM_GUARD));
+
+	guard->main_pool = g_pool;
+	guard->slot_num = slot_num;
+	guard->slot_size = 2 * pgsize;
+	guard->rate = rate;
+	guard->m_addr = mmap(0, (size_t)slot_num * guard->slot_size, PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(guard->m_addr == MAP_FAILED)
+	{
+		printf("memory pool guard area mmap failed for %u slots, errno %d.\n", slot_num, errno);
+		free(guard);
+		return NULL;
+	}
+
+	guard->alloc_size = (unsigned int*)calloc(slot_num, sizeof(unsigned int));
+	guard->freed = (unsigned char*)calloc(slot_num, sizeof(unsigned char));
+	guard->free_slots = (unsigned int*)malloc(slot_num * sizeof(unsigned int));
+	for(i = 0; i < slot_num; i++)
+	{
+		guard->free_slots[i] = i;
+	}
+	guard->free_len = slot_num;
+	pthread_mutex_init(&guard->lock, NULL);
+
+	pthread_mutex_lock(&g_guard_lock);
+	if(!handler_installed)
+	{
+		struct sigaction action;
+
+		memset(&action, 0, sizeof(action));
+		action.sa_sigaction = guard_fault_handler;
+		action.sa_flags = SA_SIGINFO;
+		sigemptyset(&action.sa_mask);
+		sigaction(SIGSEGV, &action, &g_guard_old_action);
+		handler_installed = 1;
+	}
+	guard->next = g_guard_list;
+	g_guard_list = guard;
+	pthread_mutex_unlock(&g_guard_lock);
+
+	return guard;
+}
+
+static void guard_release(MM_GUARD *guard)
+{
+	MM_GUARD **pp;
+
+	pthread_mutex_lock(&g_guard_lock);
+	for(pp = &g_guard_list; *pp != NULL; pp = &(*pp)->next)
+	{
+		if(*pp == guard)
+		{
+			*pp = guard->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&g_guard_lock);
+
+	munmap(guard->m_addr, (size_t)guard->slot_num * guard->slot_size);
+	pthread_mutex_destroy(&guard->lock);
+	free(guard->alloc_size);
+	free(guard->freed);
+	free(guard->free_slots);
+	free(guard);
+}
+
+/* Count down a random interval with mean of rate, sample at the end of it. */
+static int guard_should_sample(unsigned int rate)
+{
+	int first;
+
+	if(guard_countdown > 1)
+	{
+		guard_countdown--;
+		return 0;
+	}
+
+	first = (guard_countdown == 0);
+	if(guard_seed == 0)
+		guard_seed = (unsigned int)(uintptr_t)&guard_countdown ^ (unsigned int)time(NULL);
+	guard_countdown = 1 + rand_r(&guard_seed) % (2 * rate);
+
+	return !first;
+}
+
+/*
+** The block takes the requested size rounded up to 16 only, the alignment
+** of malloc, so an overrun of a few bytes faults too.
+*/
+static MM_BLOCK *guard_alloc(MM_GUARD *guard, unsigned int size)
+{
+	MM_BLOCK *mmb;
+	unsigned int slot;
+	BYTE *data;
+
+	size = (size + 15) & ~15U;
+	pthread_mutex_lock(&guard->lock);
+	if(guard->free_len == 0)
+	{
+		pthread_mutex_unlock(&guard->lock);
+		return NULL;
+	}
+
+	slot = guard->free_slots[guard->free_head];
+	guard->free_head = (guard->free_head + 1) % guard->slot_num;
+	guard->free_len--;
+	guard->alloc_size[slot] = size;
+	pthread_mutex_unlock(&guard->lock);
+
+	data = GUARD_SLOT_ADDR(guard, slot);
+	mprotect(data, pgsize, PROT_READ | PROT_WRITE);
+
+	/* the block ends right at the guard page */
+	mmb = ADDR_TO_MMBLOCK(data + pgsize - size);
+	mmb->pool = NULL;
+	mmb->prev = NULL;
+	mmb->size = size;
+	mmb->flags = MMB_IN_USE | MMB_GUARDED;
+	mmb->dirty = size;
+
+	return mmb;
+}
+
+static void guard_free(MM_GUARD *guard, void *addr)
+{
+	unsigned int slot;
+	BYTE *data;
+
+	slot = (unsigned int)(((BYTE*)addr - guard->m_addr) / guard->slot_size);
+	data = GUARD_SLOT_ADDR(guard, slot);
+
+	pthread_mutex_lock(&guard->lock);
+	if(guard->alloc_size[slot] == 0 || addr != data + pgsize - guard->alloc_size[slot])
+	{
+		pthread_mutex_unlock(&guard->lock);
+		printf("***** Address [%p] of sampled block is invalid or already freed, double free.*****\n", addr);
+		return;
+	}
+	ATOMIC_SUB(&POOL_COUNTER(guard->main_pool, POOL_ALLOC_SIZE), guard->alloc_size[slot]);
+	guard->alloc_size[slot] = 0;
+	guard->freed[slot] = 1;
+
+	/* drop the page and keep it inaccessible in quarantine */
+	mprotect(data, pgsize, PROT_NONE);
+	madvise(data, pgsize, MADV_DONTNEED);
+	guard->free_slots[(guard->free_head + guard->free_len) % guard->slot_num] = slot;
+	guard->free_len++;
+	pthread_mutex_unlock(&guard->lock);
+}
+
+static int _mmpool_set_guard(MM_POOL *g_pool, unsigned int rate, unsigned int slot_num)
+{
+	POOL_META *meta = g_pool->meta;
+
+	pthread_mutex_lock(&meta->grow_lock);
+	if(meta->guard == NULL && rate > 0)
+	{
+		if(slot_num == 0)
+		{
+			pthread_mutex_unlock(&meta->grow_lock);
+			printf("memory pool invalid guard slot number %u.\n", slot_num);
+			return -1;
+		}
+
+		meta->guard = guard_new(g_pool, rate, slot_num);
+		if(meta->guard == NULL)
+		{
+			pthread_mutex_unlock(&meta->grow_lock);
+			return -1;
+		}
+	}
+	else if(meta->guard != NULL)
+	{
+		/* the area is kept until destroy, for the sampled blocks alive */
+		meta->guard->rate = rate;
+	}
+	pthread_mutex_unlock(&meta->grow_lock);
+
+	return 0;
+}
+
+int mmpool_set_guard(MM_POOL *g_pool, unsigned int rate, unsigned int slot_num)
+{
+	POOL_META *meta = g_pool->meta;
+	int i;
+
+	for(i = 0; i < meta->arena_num; i++)
+	{
+		if(_mmpool_set_guard(meta->arenas[i], rate, slot_num) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
 MM_POOL *mmpool_init(void)
 {
 	MM_POOL *g_pool;
@@ -160,7 +686,7 @@ MM_POOL *mmpool_init(void)
 		return NULL;
 	}
 
-	pthread_mutex_init(&g_pool->m_lock, NULL);
+	mmpool_lock_init(&g_pool->m_lock);
 	g_pool->free_size = g_pool->size;
 	g_pool->main_pool = g_pool;
 
@@ -168,12 +694,16 @@ MM_POOL *mmpool_init(void)
         g_pool->meta = (POOL_META*)malloc(sizeof(POOL_META));
         memset(g_pool->meta, 0, sizeof(POOL_META));
         pthread_rwlock_init(&g_pool->meta->g_lock, NULL);
+        pthread_mutex_init(&g_pool->meta->grow_lock, NULL);
+        pthread_cond_init(&g_pool->meta->prov_cond, NULL);
     
         g_pool->idx = 0;
         g_pool->meta->pool_len = 1;
         g_pool->meta->pool_array[g_pool->idx] = g_pool;
 	ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_NUM));
         g_pool->meta->pool_weight[g_pool->idx]++;
+	g_pool->meta->arena_num = 1;
+	g_pool->meta->arenas[0] = g_pool;
 	/* end for main pool only */
 
 	ATOMIC_ADD(&POOL_COUNTER(g_pool, POOL_ALL_SIZE), g_pool->size);
@@ -182,6 +712,7 @@ MM_POOL *mmpool_init(void)
 	first_mmb = POOL_FIRST_MMBLOCK(g_pool);
 	first_mmb->size = g_pool->size - MM_BLOCK_HEAD_SIZE;
 	first_mmb->flags = 0;
+	first_mmb->dirty = 0;		/* fresh anonymous mapping is zero */
 	first_mmb->pool = g_pool;
 	first_mmb->prev = NULL;
 	INC_POOL_FREEBLOCKS(g_pool, first_mmb);
@@ -190,6 +721,8 @@ MM_POOL *mmpool_init(void)
 	return g_pool;
 }
 
+static void _mmpool_provision_stop(MM_POOL *g_pool);
+
 void _mmpool_destroy(MM_POOL *pool, int all)
 {
 	if(all > 0)
@@ -199,23 +732,21 @@ void _mmpool_destroy(MM_POOL *pool, int all)
 		MMB_LLE *mmb_lle, *p;
 		POOL_META *meta = pool->meta;
 
-		for(idx = 1; idx < meta->pool_len; idx++)
+		_mmpool_provision_stop(pool);
+		if(meta->guard != NULL)
+		{
+			guard_release(meta->guard);
+			meta->guard = NULL;
+		}
+		for(idx = 0; idx < meta->spare_len; idx++)
 		{
-			munmap(meta->pool_array[idx]->m_addr, meta->pool_array[idx]->size);
+			pool_release(meta->spare_pools[idx]);
+		}
+		meta->spare_len = 0;
 
-			for(j = 0; j < FREEMMB_BUCKET_SIZE; j++)
-			{
-				mmb_lle = meta->pool_array[idx]->free_blocks_list[j];
-				while(mmb_lle)
-				{
-					p = mmb_lle;
-					mmb_lle = p->next;
-					free(p);
-					ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, BLK_LIST_DEL));
-				}
-			}
-			pthread_mutex_destroy(&meta->pool_array[idx]->m_lock);
-			free(meta->pool_array[idx]);
+		for(idx = 1; idx < meta->pool_len; idx++)
+		{
+			pool_release(meta->pool_array[idx]);
 		}
 
 		if(all == 2)
@@ -233,8 +764,10 @@ void _mmpool_destroy(MM_POOL *pool, int all)
 					ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, BLK_LIST_DEL));
                                 }
                         }   
-                        pthread_mutex_destroy(&meta->pool_array[0]->m_lock);
+                        mmpool_lock_destroy(&meta->pool_array[0]->m_lock);
 			pthread_rwlock_destroy(&meta->g_lock);
+			pthread_mutex_destroy(&meta->grow_lock);
+			pthread_cond_destroy(&meta->prov_cond);
 #ifdef DEBUG
 			mmpool_dump_counter(pool);
 #endif
@@ -251,6 +784,15 @@ void _mmpool_destroy(MM_POOL *pool, int all)
 
 void mmpool_destroy(MM_POOL *pool)
 {
+	int i;
+
+	mmpool_stats_unpublish(pool);
+
+	/* the other arenas are main pools by themselves */
+	for(i = 1; i < pool->meta->arena_num; i++)
+	{
+		_mmpool_destroy(pool->meta->arenas[i], 2);
+	}
         _mmpool_destroy(pool, 2); 
 }
 
@@ -265,89 +807,198 @@ static MM_BLOCK *pool_get_next_mmb(MM_POOL *pool, MM_BLOCK *mmb)
 		return NULL;
 }
 
-static MM_BLOCK *pool_get_mmb(MM_POOL *pool, unsigned int size)
+void pool_merge(MM_POOL *pool, MM_BLOCK *mmb);
+
+/*
+** Merge all blocks parked in the quick list of the pool in one batch, the
+** pool lock must be held.
+*/
+static void pool_flush_quick(MM_POOL *pool)
 {
-	MMB_LLE *mmb_lle;
-	MM_BLOCK *mmb;
-	int i, match_index = -1;
-	
-	MM_POOL_LOCK(pool);
-	ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, POOL_GET_MMB));
+	MM_BLOCK *mmb, *next;
+	int i;
 
-	/* find a best match index */
-	i = SIZE_TO_INDEX(size);
-	for(;i < FREEMMB_BUCKET_SIZE; i++)
+	if(pool->quick_size == 0)
+		return;
+
+	for(i = 0; i < FREEMMB_BUCKET_SIZE - 1; i++)
 	{
-		if(pool->free_blocks[i] > 0)
+		for(mmb = pool->quick_list[i]; mmb != NULL; mmb = next)
 		{
-			match_index = i;
-			break;
+			next = QUICK_NEXT(mmb);
+			mmb->flags &= ~(MMB_IN_USE | MMB_DEFERRED);
+			pool_merge(pool, mmb);
 		}
+		pool->quick_list[i] = NULL;
 	}
 
-	if(match_index == -1)
-	{
-		/* no free match size block */
-		MM_POOL_UNLOCK(pool);
-		return NULL;
-	}
+	pool->quick_size = 0;
+	ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, POOL_COALESCE));
+}
 
-	mmb_lle = pool->free_blocks_list[match_index]; 
+/*
+** Get the gap between the data address of mmb and the next address aligned
+** to align. A non-zero gap must be big enough to be split off as a free
+** block by itself, i.e. a head and at least MM_BLOCK_HEAD_SIZE of data.
+*/
+static unsigned int pool_align_gap(MM_BLOCK *mmb, unsigned int align)
+{
+	uintptr_t addr, aligned;
+	unsigned int gap;
 
-	while((mmb_lle != NULL))
-	{
-		mmb = mmb_lle->mmb;
+	if(align <= MM_BLOCK_HEAD_SIZE)
+		return 0;
 
-		if(!(mmb->flags & MMB_IN_USE) && (mmb->size >= size))
-		{
-			MMB_LLE *freeb;
+	addr = (uintptr_t)MMBLOCK_TO_ADDR(mmb);
+	aligned = (addr + align - 1) & ~((uintptr_t)align - 1);
+	gap = (unsigned int)(aligned - addr);
+	if(gap > 0 && gap < 2 * MM_BLOCK_HEAD_SIZE)
+		gap += align;
 
-			/* got a free memory block in size */
-			mmb->flags |= MMB_IN_USE;
-			mmb->pool = pool;
+	return gap;
+}
 
-			/* delete the mmb from the freeblocks list */
-			freeb = mmpool_del_freelist(pool, mmb);
-			DEC_POOL_FREEBLOCKS(pool, mmb);
-			ATOMIC_DEC(&pool->main_pool->meta->pool_weight[pool->idx]);
-			
-			/* try to split the block if possiable */
-			if((mmb->size - size) > 2 * MM_BLOCK_HEAD_SIZE)
-			{
-				/* try to split the block */
-				MM_BLOCK *new_mmb, *mmb_next;
-				mmb_next = pool_get_next_mmb(pool, mmb);
-
-				new_mmb = (MM_BLOCK*)(MMBLOCK_TO_ADDR(mmb) + size);
-				new_mmb->pool = pool;
-				new_mmb->flags = 0;
-				new_mmb->size = mmb->size - size - MM_BLOCK_HEAD_SIZE;
-				new_mmb->prev = mmb;
-				if(mmb_next) mmb_next->prev = new_mmb;
-
-				/* insert new mmb to freeblocks list */
-				INC_POOL_FREEBLOCKS(pool, new_mmb);
-				ATOMIC_INC(&pool->main_pool->meta->pool_weight[pool->idx]);
-				mmpool_ins_freelist(pool, new_mmb, freeb);
-
-				/* update the new mmb size */				
-				mmb->size = size;
-			}
-			else
+static MM_BLOCK *pool_get_mmb(MM_POOL *pool, unsigned int size, unsigned int align)
+{
+	MMB_LLE *mmb_lle;
+	MM_BLOCK *mmb = NULL;
+	unsigned int gap = 0;
+	int i;
+	
+	MM_POOL_LOCK(pool);
+	ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, POOL_GET_MMB));
+
+	/* reuse a parked block of the exact size class first */
+	i = SIZE_TO_INDEX(size);
+	if(align <= MM_BLOCK_HEAD_SIZE && i >= 0 && i < FREEMMB_BUCKET_SIZE - 1 && pool->quick_list[i] != NULL)
+	{
+		mmb = pool->quick_list[i];
+		pool->quick_list[i] = QUICK_NEXT(mmb);
+		mmb->flags = MMB_IN_USE;
+		pool->quick_size -= MMBLOCK_SIZE(mmb);
+		pool->free_size -= MMBLOCK_SIZE(mmb);
+		ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, POOL_QUICK_HIT));
+		MM_POOL_UNLOCK(pool);
+		return mmb;
+	}
+
+	while(1)
+	{
+		/*
+		** Find a best match index. All blocks in a bucket except the last one
+		** have the same size, so the first non-empty bucket always fits an
+		** unaligned request, the walk only goes on for the large bucket or
+		** when the aligning gap does not fit.
+		*/
+		for(i = SIZE_TO_INDEX(size); i < FREEMMB_BUCKET_SIZE; i++)
+		{
+			if(pool->free_blocks[i] == 0)
+				continue;
+
+			for(mmb_lle = pool->free_blocks_list[i]; mmb_lle != NULL; mmb_lle = mmb_lle->next)
 			{
-				free(freeb);
-				ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, BLK_LIST_DEL));
+				mmb = mmb_lle->mmb;
+				if(mmb->flags & MMB_IN_USE)
+					continue;
+
+				gap = pool_align_gap(mmb, align);
+				if(mmb->size >= size + gap)
+					break;
 			}
 
-			pool->free_size -= MMBLOCK_SIZE(mmb);
+			if(mmb_lle != NULL)
+				break;
+		}
+
+		if(i < FREEMMB_BUCKET_SIZE)
+			break;
+
+		if(pool->quick_size == 0)
+		{
+			/* no free match size block */
 			MM_POOL_UNLOCK(pool);
-			return mmb;
-		}	
-		mmb_lle = mmb_lle->next; 
+			return NULL;
+		}
+
+		/* the size class runs dry, merge the parked blocks and try again */
+		pool_flush_quick(pool);
+	}
+
+	{
+		MMB_LLE *freeb;
+		unsigned int dirty = mmb->dirty;
+
+		/* got a free memory block in size, delete it from the freeblocks list */
+		freeb = mmpool_del_freelist(pool, mmb);
+		DEC_POOL_FREEBLOCKS(pool, mmb);
+		ATOMIC_DEC(&pool->main_pool->meta->pool_weight[pool->idx]);
+
+		if(gap > 0)
+		{
+			/* split off the leading gap and give it back as a free block */
+			MM_BLOCK *aligned_mmb, *mmb_next;
+			mmb_next = pool_get_next_mmb(pool, mmb);
+
+			aligned_mmb = (MM_BLOCK*)(MMBLOCK_TO_ADDR(mmb) + gap - MM_BLOCK_HEAD_SIZE);
+			aligned_mmb->size = mmb->size - gap;
+			aligned_mmb->prev = mmb;
+			if(mmb_next) mmb_next->prev = aligned_mmb;
+
+			/* the new head is written at the end of the gap, after its data */
+			aligned_mmb->dirty = dirty > gap ? dirty - gap : 0;
+			dirty = aligned_mmb->dirty;
+
+			mmb->size = gap - MM_BLOCK_HEAD_SIZE;
+			mmb->flags = 0;
+			if(mmb->dirty > mmb->size)
+				mmb->dirty = mmb->size;
+			INC_POOL_FREEBLOCKS(pool, mmb);
+			ATOMIC_INC(&pool->main_pool->meta->pool_weight[pool->idx]);
+			mmpool_ins_freelist(pool, mmb, freeb);
+
+			freeb = NULL;
+			mmb = aligned_mmb;
+		}
+
+		mmb->flags = MMB_IN_USE;
+		mmb->pool = pool;
+			
+		/* try to split the block if possiable */
+		if((mmb->size - size) > 2 * MM_BLOCK_HEAD_SIZE)
+		{
+			/* try to split the block */
+			MM_BLOCK *new_mmb, *mmb_next;
+			mmb_next = pool_get_next_mmb(pool, mmb);
+
+			new_mmb = (MM_BLOCK*)(MMBLOCK_TO_ADDR(mmb) + size);
+			new_mmb->pool = pool;
+			new_mmb->flags = 0;
+			new_mmb->dirty = dirty > size + MM_BLOCK_HEAD_SIZE ? dirty - size - MM_BLOCK_HEAD_SIZE : 0;
+			new_mmb->size = mmb->size - size - MM_BLOCK_HEAD_SIZE;
+			new_mmb->prev = mmb;
+			if(mmb_next) mmb_next->prev = new_mmb;
+
+			/* insert new mmb to freeblocks list */
+			INC_POOL_FREEBLOCKS(pool, new_mmb);
+			ATOMIC_INC(&pool->main_pool->meta->pool_weight[pool->idx]);
+			mmpool_ins_freelist(pool, new_mmb, freeb);
+
+			/* update the new mmb size */				
+			mmb->size = size;
+			if(mmb->dirty > size)
+				mmb->dirty = size;
+		}
+		else if(freeb != NULL)
+		{
+			free(freeb);
+			ATOMIC_INC_BIGINT(&POOL_COUNTER(pool, BLK_LIST_DEL));
+		}
+
+		pool->free_size -= MMBLOCK_SIZE(mmb);
 	}
 
 	MM_POOL_UNLOCK(pool);
-	return NULL;
+	return mmb;
 }
 
 int pool_pick_one(MM_POOL *g_pool)
@@ -391,14 +1042,127 @@ int pool_pick_one(MM_POOL *g_pool)
 	return meta->pool_len/2;
 }
 
-void *mmpool_malloc(MM_POOL *g_pool, unsigned int size)
+/*
+** Per CPU arenas. Each arena is a main pool by itself, the arena to
+** allocate from is looked up by the current CPU in arena_map, or by a
+** sequence number of the thread when the CPU is unknown. The free goes
+** through the pool of the block, so it needs no arena lookup.
+*/
+static __thread int arena_thread_seq = -1;
+static __thread unsigned int arena_thread_ops = 0;
+static int g_arena_seq = 0;
+
+/*
+** Called by a thread every ARENA_BALANCE_OPS allocations, compare the
+** allocations of arenas since last check, and move the current CPU (or
+** thread) from the busiest arena to the idlest one when it is uneven.
+*/
+static void arena_rebalance(MM_POOL *g_pool, int vcpu)
+{
+	POOL_META *meta = g_pool->meta;
+	unsigned long long ops, delta, max = 0, min = ~0ULL;
+	int i, busy = 0, idle = 0;
+
+	if(!__sync_bool_compare_and_swap(&meta->arena_balancing, 0, 1))
+		return;
+
+	for(i = 0; i < meta->arena_num; i++)
+	{
+		ops = meta->arenas[i]->meta->counter[POOL_GET_MMB];
+		delta = ops - meta->arena_ops[i];
+		meta->arena_ops[i] = ops;
+
+		if(delta > max)
+		{
+			max = delta;
+			busy = i;
+		}
+		if(delta < min)
+		{
+			min = delta;
+			idle = i;
+		}
+	}
+
+	if(max > 2 * min + ARENA_BALANCE_OPS && meta->arena_map[vcpu] == busy)
+	{
+		meta->arena_map[vcpu] = idle;
+		ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_ARENA_MOVE));
+	}
+
+	__sync_lock_release(&meta->arena_balancing);
+}
+
+static MM_POOL *arena_pick(MM_POOL *g_pool)
+{
+	POOL_META *meta = g_pool->meta;
+	int vcpu;
+
+	if(meta->arena_num <= 1)
+		return g_pool;
+
+	vcpu = sched_getcpu();
+	if(vcpu < 0)
+	{
+		/* fall back to assign arena by thread */
+		if(arena_thread_seq < 0)
+			arena_thread_seq = ATOMIC_INC(&g_arena_seq);
+		vcpu = arena_thread_seq;
+	}
+	vcpu %= MAX_CPU_NUM;
+
+	if((++arena_thread_ops % ARENA_BALANCE_OPS) == 0)
+		arena_rebalance(g_pool, vcpu);
+
+	return meta->arenas[meta->arena_map[vcpu]];
+}
+
+MM_POOL *mmpool_init_arenas(int arena_num)
+{
+	MM_POOL *g_pool;
+	POOL_META *meta;
+	int i;
+
+	if(arena_num <= 0)
+		arena_num = (int)sysconf(_SC_NPROCESSORS_ONLN);
+	if(arena_num <= 0)
+		arena_num = 1;
+	if(arena_num > MAX_ARENA_NUM)
+		arena_num = MAX_ARENA_NUM;
+
+	g_pool = mmpool_init();
+	if(g_pool == NULL)
+		return NULL;
+
+	meta = g_pool->meta;
+	for(i = 1; i < arena_num; i++)
+	{
+		meta->arenas[i] = mmpool_init();
+		if(meta->arenas[i] == NULL)
+		{
+			mmpool_destroy(g_pool);
+			return NULL;
+		}
+		meta->arena_num++;
+	}
+
+	for(i = 0; i < MAX_CPU_NUM; i++)
+	{
+		meta->arena_map[i] = i % arena_num;
+	}
+
+	return g_pool;
+}
+
+static void *_mmpool_malloc(MM_POOL *g_pool, unsigned int size, unsigned int align)
 {
 	MM_BLOCK *mmb;
 	MM_POOL  *new_pool;
 	POOL_META *meta;
-	int idx;
+	unsigned int need, req = size;
+	int idx, pool_len;
 
-	if(size == 0)
+	if(size == 0 || size > UINT_MAX - MM_BLOCK_HEAD_SIZE)
 	{
 		return NULL;
 	}
@@ -406,6 +1170,34 @@ void *mmpool_malloc(MM_POOL *g_pool, unsigned int size)
 	/* memory block will always be multiple of MM_BLOCK_HEAD_SIZE */
 	size = ((size + MM_BLOCK_HEAD_SIZE - 1) / MM_BLOCK_HEAD_SIZE) * MM_BLOCK_HEAD_SIZE;
 
+	/* sample the allocation to guard area */
+	if(g_pool->meta->guard != NULL && g_pool->meta->guard->rate > 0
+		&& align <= MM_BLOCK_HEAD_SIZE && size <= pgsize - MM_BLOCK_HEAD_SIZE
+		&& guard_should_sample(g_pool->meta->guard->rate))
+	{
+		/* the requested size, not rounded, to catch small overruns */
+		mmb = guard_alloc(g_pool->meta->guard, req);
+		if(mmb)
+		{
+			ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_GUARD_ALLOC));
+			ATOMIC_ADD(&POOL_COUNTER(g_pool, POOL_ALLOC_SIZE), mmb->size);
+			return (void*)(&mmb->align_base);
+		}
+	}
+
+	/* the worst case size of a free block to hold the aligned request */
+	need = size;
+	if(align > MM_BLOCK_HEAD_SIZE)
+	{
+		if(size > UINT_MAX - align - MM_BLOCK_HEAD_SIZE)
+			return NULL;
+		need += align + MM_BLOCK_HEAD_SIZE;
+	}
+
+	/* a new pool for it must not overflow either */
+	if(need > UINT_MAX - pgsize - MM_BLOCK_HEAD_SIZE)
+		return NULL;
+
 	MM_POOL_G_RDLOCK(g_pool);
 	/* find a befitting pool and allocate the memory */
 	idx = pool_pick_one(g_pool);
@@ -418,7 +1210,7 @@ void *mmpool_malloc(MM_POOL *g_pool, unsigned int size)
 			continue;
 		}
 
-		mmb = pool_get_mmb(meta->pool_array[idx], size);
+		mmb = pool_get_mmb(meta->pool_array[idx], size, align);
 		if(mmb)
 		{
 			MM_POOL_G_UNLOCK(g_pool);
@@ -434,7 +1226,7 @@ void *mmpool_malloc(MM_POOL *g_pool, unsigned int size)
                         continue;
                 }   
 
-                mmb = pool_get_mmb(meta->pool_array[idx], size);
+                mmb = pool_get_mmb(meta->pool_array[idx], size, align);
                 if(mmb)
                 {   
                         MM_POOL_G_UNLOCK(g_pool);
@@ -442,64 +1234,172 @@ void *mmpool_malloc(MM_POOL *g_pool, unsigned int size)
                         return (void*)(&mmb->align_base);
                 } 	
 	}
+	pool_len = meta->pool_len;
 	MM_POOL_G_UNLOCK(g_pool);
 
-	/* no available pool could alloc, new a pool to serve */
-	new_pool = (MM_POOL*)malloc(sizeof(MM_POOL));
-	memset(new_pool, 0, sizeof(MM_POOL));
+	/*
+	** No available pool could alloc, new a pool to serve. Growing is single
+	** flight, threads wait here for the one mapping a pool and then try the
+	** pools added meanwhile, only a spare pool or a new mapping is taken if
+	** they do not fit either. The pool_array is only appended under the
+	** grow_lock, so the pools could be read here without the g_lock.
+	*/
+	pthread_mutex_lock(&meta->grow_lock);
+	ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_GROW));
+	for(idx = pool_len; idx < meta->pool_len; idx++)
+	{
+		mmb = pool_get_mmb(meta->pool_array[idx], size, align);
+		if(mmb)
+		{
+			pthread_mutex_unlock(&meta->grow_lock);
+			ATOMIC_ADD(&POOL_COUNTER(g_pool, POOL_ALLOC_SIZE), mmb->size);
+			return (void*)(&mmb->align_base);
+		}
+	}
 
-	if(size > (pgsize * DEFAULT_PAGE_COUNT - MM_BLOCK_HEAD_SIZE))
+	if(need <= (pgsize * DEFAULT_PAGE_COUNT - MM_BLOCK_HEAD_SIZE) && meta->spare_len > 0)
 	{
-		new_pool->size = ((size + pgsize + MM_BLOCK_HEAD_SIZE) / pgsize) * pgsize;
+		new_pool = meta->spare_pools[--meta->spare_len];
+		ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_SPARE_HIT));
 	}
 	else
 	{
-		new_pool->size = pgsize * DEFAULT_PAGE_COUNT;
+		new_pool = pool_new(g_pool, need, 0);
 	}
 
-	new_pool->m_addr = mmap (0, new_pool->size, PROT_READ | PROT_WRITE,
-				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if(new_pool->m_addr == MAP_FAILED)
+	if(meta->spare_len < meta->spare_low)
 	{
-		printf("memory pool mmap failed for size %u, errno %d.\n", new_pool->size, errno);
-		free(new_pool);
-		return NULL;
+		/* wake up the provisioner to refill */
+		pthread_cond_signal(&meta->prov_cond);
 	}
 
-	pthread_mutex_init(&new_pool->m_lock, NULL);
-	new_pool->free_size = new_pool->size;
-	new_pool->main_pool = g_pool;
-
-        mmb = POOL_FIRST_MMBLOCK(new_pool);
-        mmb->size = new_pool->size - MM_BLOCK_HEAD_SIZE;
-        mmb->flags = 0;
-        mmb->pool = new_pool;
-	mmb->prev = NULL;
-
-	mmpool_ins_freelist(new_pool, mmb, NULL);
-	INC_POOL_FREEBLOCKS(new_pool, mmb);
+	if(new_pool == NULL)
+	{
+		pthread_mutex_unlock(&meta->grow_lock);
+		return NULL;
+	}
 
 	/* allocate memory from new pool */
-	mmb = pool_get_mmb(new_pool, size);
+	new_pool->idx = meta->pool_len;
+	mmb = pool_get_mmb(new_pool, size, align);
+	if(mmb == NULL)
+	{
+		/* the pool is not in the pool_array, keep a standard one as spare */
+		if(new_pool->size == pgsize * DEFAULT_PAGE_COUNT && meta->spare_len < MAX_SPARE_NUM)
+			meta->spare_pools[meta->spare_len++] = new_pool;
+		else
+			pool_release(new_pool);
+		pthread_mutex_unlock(&meta->grow_lock);
+		return NULL;
+	}
 
         MM_POOL_G_WRLOCK(g_pool);
 	/* add to main pool array */
-	new_pool->idx = meta->pool_len;
-	meta->pool_len++;
 	meta->pool_array[new_pool->idx] = new_pool;
+	meta->pool_len++;
 	ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_NUM));
 	meta->pool_weight[new_pool->idx]++;
 	ATOMIC_ADD(&POOL_COUNTER(g_pool, POOL_ALL_SIZE), new_pool->size);
         MM_POOL_G_UNLOCK(g_pool);
+	pthread_mutex_unlock(&meta->grow_lock);
 
 	ATOMIC_ADD(&POOL_COUNTER(g_pool, POOL_ALLOC_SIZE), mmb->size);
 	return (void*)(&mmb->align_base);
 }
 
+static void adapt_sample(MM_POOL *g_pool, unsigned int size);
+
+void *mmpool_malloc(MM_POOL *g_pool, unsigned int size)
+{
+	void *addr;
+
+	g_pool = arena_pick(g_pool);
+	if(g_pool->meta->hot_limit > 0)
+		adapt_sample(g_pool, size);
+
+	addr = _mmpool_malloc(g_pool, size, 0);
+	MMTRACE(MM_TRACE_MALLOC, addr, size, 0);
+	return addr;
+}
+
+/*
+** Clear memory for calloc. Blocks of MM_CLEAR_NT_SIZE or more are cleared
+** with non-temporal stores, so that they do not evict the cache. The data
+** of a block is always 32 bytes aligned and its size a multiple of 32.
+*/
+#define MM_CLEAR_NT_SIZE (256 * 1024)
+
+static void mm_clear(void *addr, unsigned int size)
+{
+#ifdef __SSE2__
+	if(size >= MM_CLEAR_NT_SIZE)
+	{
+		__m128i zero = _mm_setzero_si128();
+		__m128i *p = (__m128i*)addr;
+		__m128i *end = (__m128i*)((BYTE*)addr + (size & ~63U));
+
+		for(; p < end; p += 4)
+		{
+			_mm_stream_si128(p, zero);
+			_mm_stream_si128(p + 1, zero);
+			_mm_stream_si128(p + 2, zero);
+			_mm_stream_si128(p + 3, zero);
+		}
+		/* order the streaming stores before the memory is handed out */
+		_mm_sfence();
+		memset(end, 0, size & 63U);
+		return;
+	}
+#endif
+	memset(addr, 0, size);
+}
+
+void *mmpool_calloc(MM_POOL *g_pool, unsigned int nmemb, unsigned int size)
+{
+	MM_BLOCK *mmb;
+	void *addr;
+
+	/* the product and the block head must fit in unsigned int */
+	if(nmemb != 0 && size > (UINT_MAX - MM_BLOCK_HEAD_SIZE) / nmemb)
+		return NULL;
+
+	addr = mmpool_malloc(g_pool, nmemb * size);
+	if(addr == NULL)
+		return NULL;
+
+	/* only the dirty part of the block, it is all for guard blocks */
+	mmb = ADDR_TO_MMBLOCK(addr);
+	size *= nmemb;
+	if(mmb->dirty == 0)
+	{
+		ATOMIC_INC_BIGINT(&POOL_COUNTER((MM_POOL*)mmb->pool, POOL_ZERO_HIT));
+		return addr;
+	}
+
+	mm_clear(addr, mmb->dirty < size ? mmb->dirty : size);
+	return addr;
+}
+
+void *mmpool_aligned_alloc(MM_POOL *g_pool, unsigned int align, unsigned int size)
+{
+	void *addr;
+
+	if(align == 0 || (align & (align - 1)) != 0)
+	{
+		printf("memory pool invalid alignment %u, must be power of 2.\n", align);
+		return NULL;
+	}
+
+	addr = _mmpool_malloc(arena_pick(g_pool), size, align);
+	MMTRACE(MM_TRACE_MALLOC, addr, size, align);
+	return addr;
+}
+
 void pool_merge(MM_POOL *pool, MM_BLOCK *mmb)
 {
 	MM_BLOCK *mmb_prev, *mmb_next;
 	MMB_LLE *mmb_lle_prev = NULL, *mmb_lle_next =  NULL;
+	unsigned int dirty = mmb->dirty;
 
 	mmb_prev = mmb->prev;
 	/* merge with prev block*/
@@ -518,6 +1418,9 @@ void pool_merge(MM_POOL *pool, MM_BLOCK *mmb)
 		DEC_POOL_FREEBLOCKS(pool, mmb_prev);
 		ATOMIC_DEC(&pool->main_pool->meta->pool_weight[pool->idx]);
 
+		/* the head merged is cleared, so the dirty part ends in the last dirty block */
+		dirty = dirty > 0 ? MMBLOCK_SIZE(mmb_prev) + dirty : mmb_prev->dirty;
+
 		/* update the prev size and update mmb to new prev */
                 mmb_prev->size += MMBLOCK_SIZE(mmb);
 		memset(mmb, 0, MM_BLOCK_HEAD_SIZE);
@@ -542,9 +1445,12 @@ void pool_merge(MM_POOL *pool, MM_BLOCK *mmb)
 		ATOMIC_DEC(&pool->main_pool->meta->pool_weight[pool->idx]);
 
 		/* update the mmb to new size merged with next */
+		if(mmb_next->dirty > 0)
+			dirty = MMBLOCK_SIZE(mmb) + mmb_next->dirty;
 		mmb->size += MMBLOCK_SIZE(mmb_next);
 		memset(mmb_next, 0, MM_BLOCK_HEAD_SIZE);
 	}
+	mmb->dirty = dirty;
 
 	if(mmb_lle_prev != NULL)
 	{
@@ -574,50 +1480,1017 @@ void pool_merge(MM_POOL *pool, MM_BLOCK *mmb)
 
 }
 
-void mmpool_free(void *addr)
+/*
+** Check a block to free, a sampled block is freed to the guard area here.
+** Returns the block to put back to its pool, NULL for none.
+*/
+static MM_BLOCK *pool_free_check(void *addr)
 {
 	MM_BLOCK *mmb;
-	MM_POOL  *cur_pool;
 
-	if(addr == NULL)
-		return;
+	if(g_guard_list != NULL)
+	{
+		/* sampled blocks, the head may not be accessible after free */
+		MM_GUARD *guard = guard_find(addr);
+		if(guard != NULL)
+		{
+			guard_free(guard, addr);
+			return NULL;
+		}
+	}
 
 	mmb = ADDR_TO_MMBLOCK(addr);
-	if(!(mmb->flags & MMB_IN_USE))
+	if(!(mmb->flags & MMB_IN_USE) || (mmb->flags & MMB_DEFERRED))
 	{
 		printf("***** Address [%p] has already been freed, double free.*****\n", addr);
-		return;
+		return NULL;
 	}
 
-	cur_pool = (MM_POOL*)mmb->pool;
+	return mmb;
+}
+
+/* Put a block back to its pool, parked or merged, with the pool lock held. */
+static void pool_put_mmb(MM_POOL *cur_pool, MM_BLOCK *mmb)
+{
+	POOL_META *meta = cur_pool->main_pool->meta;
+	unsigned int limit = meta->deferred_limit;
+	int index;
 
-	MM_POOL_LOCK(cur_pool);
-	mmb->flags &= ~MMB_IN_USE;
 	cur_pool->free_size += MMBLOCK_SIZE(mmb);
 	ATOMIC_SUB(&POOL_COUNTER(cur_pool, POOL_ALLOC_SIZE), mmb->size);
 
+	index = SIZE_TO_INDEX(mmb->size);
+	/* blocks of hot classes are parked even if deferring is disabled */
+	if(limit == 0 && index < FREEMMB_BUCKET_SIZE - 1 && meta->hot_map[index])
+		limit = meta->hot_limit;
+
+	if(limit > 0 && index < FREEMMB_BUCKET_SIZE - 1)
+	{
+		/* merge the parked blocks in batch once over the limit */
+		if(cur_pool->quick_size + MMBLOCK_SIZE(mmb) > limit)
+			pool_flush_quick(cur_pool);
+
+		/* park the block, it keeps MMB_IN_USE so that neighbours do not merge it */
+		mmb->flags |= MMB_DEFERRED;
+		mmb->dirty = mmb->size;
+		QUICK_NEXT(mmb) = cur_pool->quick_list[index];
+		cur_pool->quick_list[index] = mmb;
+		cur_pool->quick_size += MMBLOCK_SIZE(mmb);
+		return;
+	}
+
+	/* the data written by the caller is not known zero any more */
+	mmb->flags &= ~MMB_IN_USE;
+	mmb->dirty = mmb->size;
+
 	/* try the merge the memory block and update the free blocks */
 	pool_merge(cur_pool, mmb);
+}
+
+static void _mmpool_free(void *addr)
+{
+	MM_BLOCK *mmb;
+	MM_POOL  *cur_pool;
+
+	mmb = pool_free_check(addr);
+	if(mmb == NULL)
+		return;
+
+	cur_pool = (MM_POOL*)mmb->pool;
+	MM_POOL_LOCK(cur_pool);
+	pool_put_mmb(cur_pool, mmb);
 	MM_POOL_UNLOCK(cur_pool);
 }
 
-void _mmpool_dump(MM_POOL *pool, int all)
+void mmpool_free(void *addr)
 {
-	POOL_META *meta;
-	MM_POOL *cur_pool;
-	int idx = 0;
+	if(addr == NULL)
+		return;
 
-	printf("---------------------------------- START DUMP MMPOOL ----------------------------------\n");
-	cur_pool = pool;
-	do
-	{
-		MM_BLOCK *mmb;
-		int i;
+	MMTRACE(MM_TRACE_FREE, addr, 0, 0);
+	_mmpool_free(addr);
+}
 
-		MM_POOL_LOCK(cur_pool);
-		printf("*********************************** START THIS POOL **************************************\n");
-		printf("   POOL OVER ALL: start addr [%p] size [%d] freesize [%d] freeblocks: \n",
-			cur_pool->m_addr, cur_pool->size, cur_pool->free_size);
+void mmpool_set_deferred(MM_POOL *g_pool, unsigned int limit)
+{
+	POOL_META *meta = g_pool->meta;
+	int i;
+
+	for(i = 0; i < meta->arena_num; i++)
+	{
+		meta->arenas[i]->meta->deferred_limit = limit;
+	}
+
+	if(limit == 0)
+	{
+		mmpool_flush(g_pool);
+	}
+}
+
+static void _mmpool_flush(MM_POOL *g_pool)
+{
+	POOL_META *meta = g_pool->meta;
+	int idx;
+
+	MM_POOL_G_RDLOCK(g_pool);
+	for(idx = 0; idx < meta->pool_len; idx++)
+	{
+		MM_POOL_LOCK(meta->pool_array[idx]);
+		pool_flush_quick(meta->pool_array[idx]);
+		MM_POOL_UNLOCK(meta->pool_array[idx]);
+	}
+	MM_POOL_G_UNLOCK(g_pool);
+}
+
+void mmpool_flush(MM_POOL *g_pool)
+{
+	int i;
+
+	for(i = 0; i < g_pool->meta->arena_num; i++)
+	{
+		_mmpool_flush(g_pool->meta->arenas[i]);
+	}
+}
+
+/*
+** Adaptive size classes. One in ADAPT_SAMPLE requests of a thread is counted
+** in the size histogram of the arena, and every ADAPT_PERIOD samples the top
+** classes with at least 1/ADAPT_MIN_SHARE of the samples are picked as hot.
+** The histogram is halved then, so that the old profile decays.
+*/
+#define ADAPT_SAMPLE 16
+#define ADAPT_PERIOD 8192
+#define ADAPT_MIN_SHARE 64
+
+static __thread unsigned int adapt_thread_ops = 0;
+
+/* Whether the arena has blocks of the class parked in any of its pools. */
+static int adapt_parked(MM_POOL *g_pool, unsigned int size)
+{
+	POOL_META *meta = g_pool->meta;
+	int idx, index = SIZE_TO_INDEX(size), pool_len = meta->pool_len;
+
+	/* pools are only appended, a racy read of the list heads is a hint */
+	for(idx = 0; idx < pool_len; idx++)
+	{
+		if(meta->pool_array[idx]->quick_list[index] != NULL)
+			return 1;
+	}
+
+	return 0;
+}
+
+/* Allocate and park blocks of a class newly hot, up to the prewarm size. */
+static void adapt_prewarm(MM_POOL *g_pool, unsigned int size)
+{
+	POOL_META *meta = g_pool->meta;
+	unsigned int total, limit;
+	void *addr, *list = NULL;
+
+	if(adapt_parked(g_pool, size))
+		return;
+
+	/* keep the prewarmed blocks under the parking limit of classes */
+	limit = meta->deferred_limit > 0 ? meta->deferred_limit : meta->hot_limit;
+	total = meta->hot_prewarm;
+	if(total > limit / MM_HOT_CLASS_NUM)
+		total = limit / MM_HOT_CLASS_NUM;
+
+	for(; total >= size + MM_BLOCK_HEAD_SIZE; total -= size + MM_BLOCK_HEAD_SIZE)
+	{
+		addr = _mmpool_malloc(g_pool, size, 0);
+		if(addr == NULL)
+			break;
+		*(void**)addr = list;
+		list = addr;
+	}
+
+	/* freed all together, so they are parked instead of merged back */
+	while(list != NULL)
+	{
+		addr = list;
+		list = *(void**)addr;
+		_mmpool_free(addr);
+	}
+}
+
+static void adapt_reconfig(MM_POOL *g_pool)
+{
+	POOL_META *meta = g_pool->meta;
+	unsigned char hot_map[FREEMMB_BUCKET_SIZE - 1];
+	unsigned int hot_class[MM_HOT_CLASS_NUM];
+	unsigned int total = 0, max;
+	int i, k, best, changed = 0;
+
+	if(!__sync_bool_compare_and_swap(&meta->adapt_running, 0, 1))
+		return;
+
+	for(i = 0; i < FREEMMB_BUCKET_SIZE - 1; i++)
+		total += meta->size_hist[i];
+
+	/* pick the top classes, a class must be hot enough to be worth parking */
+	memset(hot_map, 0, sizeof(hot_map));
+	memset(hot_class, 0, sizeof(hot_class));
+	for(k = 0; k < MM_HOT_CLASS_NUM; k++)
+	{
+		best = -1;
+		max = total / ADAPT_MIN_SHARE;
+		for(i = 0; i < FREEMMB_BUCKET_SIZE - 1; i++)
+		{
+			if(!hot_map[i] && meta->size_hist[i] > max)
+			{
+				max = meta->size_hist[i];
+				best = i;
+			}
+		}
+		if(best < 0)
+			break;
+		hot_map[best] = 1;
+		hot_class[k] = (best + 1) * MM_BLOCK_HEAD_SIZE;
+	}
+
+	/* counts added in the meantime are lost, the histogram is a hint only */
+	for(i = 0; i < FREEMMB_BUCKET_SIZE - 1; i++)
+	{
+		meta->size_hist[i] >>= 1;
+		if(hot_map[i] != meta->hot_map[i])
+		{
+			meta->hot_map[i] = hot_map[i];
+			changed = 1;
+		}
+	}
+	memcpy(meta->hot_class, hot_class, sizeof(hot_class));
+	meta->hist_samples = 0;
+
+	if(changed)
+	{
+		ATOMIC_INC_BIGINT(&POOL_COUNTER(g_pool, POOL_ADAPT));
+	}
+
+	if(changed && meta->hot_prewarm > 0)
+	{
+		pthread_mutex_lock(&meta->grow_lock);
+		if(meta->prov_running)
+		{
+			/* hand it over to the provisioner, not to stall this allocation */
+			memcpy(meta->prewarm_class, hot_class, sizeof(hot_class));
+			meta->prewarm_pending = 1;
+			pthread_cond_signal(&meta->prov_cond);
+			pthread_mutex_unlock(&meta->grow_lock);
+		}
+		else
+		{
+			pthread_mutex_unlock(&meta->grow_lock);
+			for(k = 0; k < MM_HOT_CLASS_NUM && hot_class[k] > 0; k++)
+				adapt_prewarm(g_pool, hot_class[k]);
+		}
+	}
+
+	meta->adapt_running = 0;
+}
+
+static void adapt_sample(MM_POOL *g_pool, unsigned int size)
+{
+	POOL_META *meta = g_pool->meta;
+	unsigned int index;
+
+	if((++adapt_thread_ops % ADAPT_SAMPLE) != 0 || size == 0)
+		return;
+
+	/* the same rounding as _mmpool_malloc, larger sizes have no class */
+	size = ((size + MM_BLOCK_HEAD_SIZE - 1) / MM_BLOCK_HEAD_SIZE) * MM_BLOCK_HEAD_SIZE;
+	index = SIZE_TO_INDEX(size);
+	if(index >= FREEMMB_BUCKET_SIZE - 1)
+		return;
+
+	ATOMIC_INC(&meta->size_hist[index]);
+	if(ATOMIC_INC(&meta->hist_samples) >= ADAPT_PERIOD)
+		adapt_reconfig(g_pool);
+}
+
+void mmpool_set_adaptive(MM_POOL *g_pool, unsigned int limit, unsigned int prewarm)
+{
+	POOL_META *meta;
+	int i;
+
+	for(i = 0; i < g_pool->meta->arena_num; i++)
+	{
+		meta = g_pool->meta->arenas[i]->meta;
+		meta->hot_prewarm = prewarm;
+		meta->hot_limit = limit;
+		if(limit == 0)
+		{
+			/* forget the profile, it starts over once enabled again */
+			memset(meta->hot_map, 0, sizeof(meta->hot_map));
+			memset(meta->hot_class, 0, sizeof(meta->hot_class));
+			memset(meta->size_hist, 0, sizeof(meta->size_hist));
+			meta->hist_samples = 0;
+		}
+	}
+
+	if(limit == 0 && g_pool->meta->deferred_limit == 0)
+	{
+		mmpool_flush(g_pool);
+	}
+}
+
+/*
+** Epoch based reclamation, process wide for all memory pools. The global
+** epoch advances when all threads in a critical section have seen it, and
+** a block retired in epoch e is freed once the epoch reaches e + 2. Each
+** thread keeps three limbo lists, one for each epoch modulo 3. Records of
+** threads are never freed, the record of an exited thread is reused by the
+** next new thread together with its limbo lists.
+*/
+#define EPOCH_LIMBO_NUM 3
+#define EPOCH_BATCH 64			/* retires of a thread between advances */
+
+typedef struct mm_epoch_limbo
+{
+	unsigned long long epoch;	/* epoch of the blocks retired */
+	void **addrs;			/* blocks retired */
+	unsigned int len;
+	unsigned int cap;
+}MM_EPOCH_LIMBO;
+
+typedef struct mm_epoch_rec
+{
+	struct mm_epoch_rec *next;	/* all records for advancing */
+	volatile unsigned long long local; /* epoch seen << 1 | in critical section */
+	int nest;			/* nesting of critical sections */
+	int lock;			/* spin lock of limbo lists, for the barrier */
+	int in_use;			/* owned by a live thread */
+	unsigned int retired;		/* blocks retired by the owner */
+	MM_EPOCH_LIMBO limbo[EPOCH_LIMBO_NUM];
+}MM_EPOCH_REC;
+
+static volatile unsigned long long g_epoch = 0;
+static MM_EPOCH_REC *g_epoch_recs = NULL;
+static pthread_mutex_t g_epoch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_epoch_key;
+static pthread_once_t g_epoch_once = PTHREAD_ONCE_INIT;
+static __thread MM_EPOCH_REC *t_epoch_rec = NULL;
+
+#define EPOCH_REC_LOCK(rec) while(__sync_lock_test_and_set(&(rec)->lock, 1)) sched_yield()
+#define EPOCH_REC_UNLOCK(rec) __sync_lock_release(&(rec)->lock)
+
+static void epoch_thread_exit(void *arg)
+{
+	MM_EPOCH_REC *rec = (MM_EPOCH_REC*)arg;
+
+	/* leave the critical section forgotten, it would block advancing */
+	rec->nest = 0;
+	rec->local = 0;
+	rec->in_use = 0;
+}
+
+static void epoch_key_init(void)
+{
+	pthread_key_create(&g_epoch_key, epoch_thread_exit);
+}
+
+static MM_EPOCH_REC *epoch_rec_get(void)
+{
+	MM_EPOCH_REC *rec = t_epoch_rec;
+
+	if(rec != NULL)
+		return rec;
+
+	pthread_once(&g_epoch_once, epoch_key_init);
+
+	pthread_mutex_lock(&g_epoch_lock);
+	for(rec = g_epoch_recs; rec != NULL; rec = rec->next)
+	{
+		if(!rec->in_use)
+			break;
+	}
+
+	if(rec == NULL)
+	{
+		rec = (MM_EPOCH_REC*)malloc(sizeof(MM_EPOCH_REC));
+		if(rec == NULL)
+		{
+			pthread_mutex_unlock(&g_epoch_lock);
+			return NULL;
+		}
+		memset(rec, 0, sizeof(MM_EPOCH_REC));
+		rec->next = g_epoch_recs;
+		g_epoch_recs = rec;
+	}
+	rec->in_use = 1;
+	pthread_mutex_unlock(&g_epoch_lock);
+
+	pthread_setspecific(g_epoch_key, rec);
+	t_epoch_rec = rec;
+
+	return rec;
+}
+
+static int epoch_addr_cmp(const void *a, const void *b)
+{
+	uintptr_t pa = (uintptr_t)(ADDR_TO_MMBLOCK(*(void* const*)a))->pool;
+	uintptr_t pb = (uintptr_t)(ADDR_TO_MMBLOCK(*(void* const*)b))->pool;
+
+	return pa < pb ? -1 : (pa > pb ? 1 : 0);
+}
+
+/* Free the blocks of a limbo list, the blocks of a pool under one lock. */
+static void epoch_free_limbo(MM_EPOCH_LIMBO *limbo)
+{
+	MM_POOL *cur_pool;
+	unsigned int i, j, len = 0;
+
+	for(i = 0; i < limbo->len; i++)
+	{
+		MMTRACE(MM_TRACE_FREE, limbo->addrs[i], 0, 0);
+
+		/* guard blocks are freed here, they have no pool to lock */
+		if(pool_free_check(limbo->addrs[i]) != NULL)
+			limbo->addrs[len++] = limbo->addrs[i];
+	}
+
+	qsort(limbo->addrs, len, sizeof(void*), epoch_addr_cmp);
+
+	for(i = 0; i < len; i = j)
+	{
+		cur_pool = (MM_POOL*)(ADDR_TO_MMBLOCK(limbo->addrs[i]))->pool;
+
+		MM_POOL_LOCK(cur_pool);
+		for(j = i; j < len && (ADDR_TO_MMBLOCK(limbo->addrs[j]))->pool == cur_pool; j++)
+		{
+			pool_put_mmb(cur_pool, ADDR_TO_MMBLOCK(limbo->addrs[j]));
+		}
+		MM_POOL_UNLOCK(cur_pool);
+		ATOMIC_ADD(&POOL_COUNTER(cur_pool, POOL_EPOCH_FREE), j - i);
+	}
+
+	limbo->len = 0;
+}
+
+/* Advance the global epoch if all threads in critical sections have seen it. */
+static void epoch_try_advance(void)
+{
+	unsigned long long epoch = g_epoch;
+	MM_EPOCH_REC *rec;
+
+	__sync_synchronize();
+
+	/* records are only pushed at head, the list from a head taken is stable */
+	for(rec = g_epoch_recs; rec != NULL; rec = rec->next)
+	{
+		unsigned long long local = rec->local;
+
+		if((local & 1) && (local >> 1) != epoch)
+			return;
+	}
+
+	__sync_bool_compare_and_swap(&g_epoch, epoch, epoch + 1);
+}
+
+/* Free the limbo lists out of the grace period, with the record lock held. */
+static void epoch_reclaim(MM_EPOCH_REC *rec)
+{
+	unsigned long long epoch = g_epoch;
+	int i;
+
+	for(i = 0; i < EPOCH_LIMBO_NUM; i++)
+	{
+		if(rec->limbo[i].len > 0 && rec->limbo[i].epoch + 2 <= epoch)
+			epoch_free_limbo(&rec->limbo[i]);
+	}
+}
+
+void mmpool_epoch_enter(void)
+{
+	MM_EPOCH_REC *rec = epoch_rec_get();
+
+	if(rec == NULL || rec->nest++ > 0)
+		return;
+
+	rec->local = (g_epoch << 1) | 1;
+	/* the epoch seen must be visible before any read of the section */
+	__sync_synchronize();
+}
+
+void mmpool_epoch_exit(void)
+{
+	MM_EPOCH_REC *rec = t_epoch_rec;
+
+	if(rec == NULL || rec->nest == 0 || --rec->nest > 0)
+		return;
+
+	__sync_synchronize();
+	rec->local = 0;
+}
+
+void mmpool_retire(void *addr)
+{
+	MM_EPOCH_REC *rec;
+	MM_EPOCH_LIMBO *limbo;
+	unsigned long long epoch;
+
+	if(addr == NULL)
+		return;
+
+	rec = epoch_rec_get();
+	if(rec == NULL)
+	{
+		printf("memory pool retire [%p] failed, it is leaked.\n", addr);
+		return;
+	}
+
+	EPOCH_REC_LOCK(rec);
+	epoch = g_epoch;
+	limbo = &rec->limbo[epoch % EPOCH_LIMBO_NUM];
+
+	/* the list of the same slot was retired 3 epochs ago at least */
+	if(limbo->len > 0 && limbo->epoch != epoch)
+		epoch_free_limbo(limbo);
+	limbo->epoch = epoch;
+
+	if(limbo->len == limbo->cap)
+	{
+		unsigned int cap = limbo->cap ? limbo->cap * 2 : EPOCH_BATCH;
+		void **addrs = (void**)realloc(limbo->addrs, cap * sizeof(void*));
+
+		if(addrs == NULL)
+		{
+			EPOCH_REC_UNLOCK(rec);
+			printf("memory pool retire [%p] failed, it is leaked.\n", addr);
+			return;
+		}
+		limbo->addrs = addrs;
+		limbo->cap = cap;
+	}
+	limbo->addrs[limbo->len++] = addr;
+
+	if((++rec->retired % EPOCH_BATCH) == 0)
+	{
+		epoch_try_advance();
+		epoch_reclaim(rec);
+	}
+	EPOCH_REC_UNLOCK(rec);
+}
+
+void mmpool_epoch_barrier(void)
+{
+	unsigned long long target = g_epoch + 2;
+	MM_EPOCH_REC *rec;
+
+	while(g_epoch < target)
+	{
+		epoch_try_advance();
+		if(g_epoch < target)
+			sched_yield();
+	}
+
+	pthread_mutex_lock(&g_epoch_lock);
+	rec = g_epoch_recs;
+	pthread_mutex_unlock(&g_epoch_lock);
+
+	for(; rec != NULL; rec = rec->next)
+	{
+		EPOCH_REC_LOCK(rec);
+		epoch_reclaim(rec);
+		EPOCH_REC_UNLOCK(rec);
+	}
+}
+
+/*
+** Background provisioner, keep spare_low pools mapped (and prefaulted) ahead
+** of time, so that growing takes a ready pool instead of mapping inline.
+*/
+static void *pool_provision_func(void *arg)
+{
+	MM_POOL *g_pool = (MM_POOL*)arg;
+	POOL_META *meta = g_pool->meta;
+	MM_POOL *new_pool;
+
+	pthread_mutex_lock(&meta->grow_lock);
+	while(meta->prov_running)
+	{
+		if(meta->prewarm_pending)
+		{
+			unsigned int hot_class[MM_HOT_CLASS_NUM];
+			int k;
+
+			/* prewarm hot classes without the grow_lock, it may grow */
+			memcpy(hot_class, meta->prewarm_class, sizeof(hot_class));
+			meta->prewarm_pending = 0;
+			pthread_mutex_unlock(&meta->grow_lock);
+			for(k = 0; k < MM_HOT_CLASS_NUM && hot_class[k] > 0; k++)
+				adapt_prewarm(g_pool, hot_class[k]);
+			pthread_mutex_lock(&meta->grow_lock);
+			continue;
+		}
+
+		if(meta->spare_len < meta->spare_low)
+		{
+			/* map without the grow_lock, growing should not wait for it */
+			pthread_mutex_unlock(&meta->grow_lock);
+			new_pool = pool_new(g_pool, 0, meta->spare_prefault);
+			pthread_mutex_lock(&meta->grow_lock);
+
+			if(new_pool == NULL)
+			{
+				/* out of memory, wait for next signal to retry */
+				pthread_cond_wait(&meta->prov_cond, &meta->grow_lock);
+				continue;
+			}
+
+			meta->spare_pools[meta->spare_len++] = new_pool;
+			continue;
+		}
+
+		pthread_cond_wait(&meta->prov_cond, &meta->grow_lock);
+	}
+	pthread_mutex_unlock(&meta->grow_lock);
+
+	return NULL;
+}
+
+static int _mmpool_provision_start(MM_POOL *g_pool, int spare_num, int prefault)
+{
+	POOL_META *meta = g_pool->meta;
+	int ret = 0;
+
+	if(spare_num <= 0 || spare_num > MAX_SPARE_NUM)
+	{
+		printf("memory pool invalid spare pool number %d.\n", spare_num);
+		return -1;
+	}
+
+	pthread_mutex_lock(&meta->grow_lock);
+	meta->spare_low = spare_num;
+	meta->spare_prefault = prefault;
+
+	if(!meta->prov_running)
+	{
+		meta->prov_running = 1;
+		ret = pthread_create(&meta->prov_thread, NULL, pool_provision_func, g_pool);
+		if(ret != 0)
+		{
+			printf("memory pool provisioner create failed, errno %d.\n", ret);
+			meta->prov_running = 0;
+			meta->spare_low = 0;
+			ret = -1;
+		}
+	}
+	else
+	{
+		pthread_cond_signal(&meta->prov_cond);
+	}
+	pthread_mutex_unlock(&meta->grow_lock);
+
+	return ret;
+}
+
+static void _mmpool_provision_stop(MM_POOL *g_pool)
+{
+	POOL_META *meta = g_pool->meta;
+	int running;
+
+	pthread_mutex_lock(&meta->grow_lock);
+	running = meta->prov_running;
+	meta->prov_running = 0;
+	meta->spare_low = 0;
+	pthread_cond_signal(&meta->prov_cond);
+	pthread_mutex_unlock(&meta->grow_lock);
+
+	if(running)
+	{
+		pthread_join(meta->prov_thread, NULL);
+	}
+}
+
+int mmpool_provision_start(MM_POOL *g_pool, int spare_num, int prefault)
+{
+	POOL_META *meta = g_pool->meta;
+	int i;
+
+	for(i = 0; i < meta->arena_num; i++)
+	{
+		if(_mmpool_provision_start(meta->arenas[i], spare_num, prefault) != 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+void mmpool_provision_stop(MM_POOL *g_pool)
+{
+	POOL_META *meta = g_pool->meta;
+	int i;
+
+	for(i = 0; i < meta->arena_num; i++)
+	{
+		_mmpool_provision_stop(meta->arenas[i]);
+	}
+}
+
+/* Largest free block of the pool, read without the pool lock. */
+static unsigned int pool_largest_free(MM_POOL *pool)
+{
+	int i;
+
+	if(pool->free_blocks[FREEMMB_BUCKET_SIZE-1] > 0 && pool->large_max > 0)
+		return pool->large_max;
+
+	for(i = FREEMMB_BUCKET_SIZE - 2; i >= 0; i--)
+	{
+		if(pool->free_blocks[i] > 0)
+			return (i + 1) * MM_BLOCK_HEAD_SIZE;
+	}
+
+	return 0;
+}
+
+void mmpool_get_stats(MM_POOL *g_pool, MM_POOL_STATS *stats)
+{
+	POOL_META *meta;
+	MM_POOL *pool;
+	unsigned long long largest_sum = 0;
+	int i, j, k, pool_len;
+
+	memset(stats, 0, sizeof(MM_POOL_STATS));
+	stats->arena_num = g_pool->meta->arena_num;
+
+	for(i = 0; i < g_pool->meta->arena_num; i++)
+	{
+		meta = g_pool->meta->arenas[i]->meta;
+
+		for(k = 0; k < MAX_COUNTER_SIZE; k++)
+			stats->counter[k] += meta->counter[k];
+
+		/* union of hot classes of arenas, as many as fit */
+		for(k = 0; k < MM_HOT_CLASS_NUM && meta->hot_class[k] > 0; k++)
+		{
+			unsigned int h;
+
+			for(h = 0; h < MM_HOT_CLASS_NUM; h++)
+			{
+				if(stats->hot_class[h] == meta->hot_class[k] || stats->hot_class[h] == 0)
+				{
+					stats->hot_class[h] = meta->hot_class[k];
+					break;
+				}
+			}
+		}
+
+		/* pools are only appended and never removed until destroy */
+		pool_len = meta->pool_len;
+		for(j = 0; j < pool_len; j++)
+		{
+			unsigned int free_blocks = 0, largest;
+
+			pool = meta->pool_array[j];
+			for(k = 0; k < FREEMMB_BUCKET_SIZE; k++)
+			{
+				unsigned int n = pool->free_blocks[k];
+				int h = 0;
+
+				if(n == 0)
+					continue;
+				free_blocks += n;
+
+				/* size class of bucket k is (k + 1) * 32, the last one is larger */
+				while(h < MM_STATS_HIST_SIZE - 1 && ((k + 1) >> (h + 1)) > 0)
+					h++;
+				if(k == FREEMMB_BUCKET_SIZE - 1)
+					h = MM_STATS_HIST_SIZE - 1;
+				stats->hist[h] += n;
+			}
+
+			largest = pool_largest_free(pool);
+			stats->mapped_size += pool->size;
+			stats->free_size += pool->free_size;
+			stats->parked_size += pool->quick_size;
+			stats->free_blocks += free_blocks;
+			stats->lock_acquires += pool->m_lock.acquires;
+			stats->lock_contended += pool->m_lock.contended;
+			stats->lock_wait_ns += pool->m_lock.wait_ns;
+			largest_sum += largest;
+			if(largest > stats->largest_free)
+				stats->largest_free = largest;
+
+			if(stats->pool_num < MAX_POOL_NUM)
+			{
+				MM_SUBPOOL_STATS *ps = &stats->pools[stats->pool_num++];
+
+				ps->arena = i;
+				ps->size = pool->size;
+				ps->free_size = pool->free_size;
+				ps->used_size = pool->size - ps->free_size;
+				ps->free_blocks = free_blocks;
+				ps->largest_free = largest;
+				ps->lock_acquires = pool->m_lock.acquires;
+				ps->lock_contended = pool->m_lock.contended;
+				ps->lock_wait_ns = pool->m_lock.wait_ns;
+			}
+		}
+	}
+
+	stats->alloc_size = stats->counter[POOL_ALLOC_SIZE];
+	/* pools never merge each other, so the largest free is of each pool */
+	if(stats->free_size > 0 && largest_sum < stats->free_size)
+		stats->fragmentation = 1.0 - (double)largest_sum / stats->free_size;
+}
+
+/*
+** Shared stats page, mapped from a file and refreshed by a background
+** thread of the allocator, with a sequence lock for the readers.
+*/
+typedef struct mm_stats_pub
+{
+	MM_STATS_PAGE *page;		/* shared mapping of the stats file */
+	MM_POOL *g_pool;		/* memory pool published */
+	unsigned int interval_ms;	/* update interval */
+	int running;			/* publisher thread is running */
+	pthread_t thread;		/* publisher thread */
+	pthread_mutex_t lock;		/* protect running for the cond */
+	pthread_cond_t cond;		/* wake up publisher to stop */
+	MM_POOL_STATS stats;		/* snapshot aside, readers only wait for a copy */
+}MM_STATS_PUB;
+
+static void stats_page_update(MM_STATS_PUB *pub)
+{
+	MM_STATS_PAGE *page = pub->page;
+
+	mmpool_get_stats(pub->g_pool, &pub->stats);
+
+	page->seq++;
+	__sync_synchronize();
+	memcpy(&page->stats, &pub->stats, sizeof(MM_POOL_STATS));
+	page->update_ts = (unsigned long long)time(NULL);
+	__sync_synchronize();
+	page->seq++;
+}
+
+static void *stats_publish_func(void *arg)
+{
+	MM_STATS_PUB *pub = (MM_STATS_PUB*)arg;
+	struct timespec ts;
+
+	pthread_mutex_lock(&pub->lock);
+	while(pub->running)
+	{
+		pthread_mutex_unlock(&pub->lock);
+		stats_page_update(pub);
+		pthread_mutex_lock(&pub->lock);
+
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_sec += pub->interval_ms / 1000;
+		ts.tv_nsec += (pub->interval_ms % 1000) * 1000000L;
+		if(ts.tv_nsec >= 1000000000L)
+		{
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if(pub->running)
+			pthread_cond_timedwait(&pub->cond, &pub->lock, &ts);
+	}
+	pthread_mutex_unlock(&pub->lock);
+
+	return NULL;
+}
+
+int mmpool_stats_publish(MM_POOL *g_pool, const char *path, unsigned int interval_ms)
+{
+	POOL_META *meta = g_pool->meta;
+	MM_STATS_PUB *pub;
+	int fd, ret;
+
+	if(meta->stats_pub != NULL)
+	{
+		printf("memory pool stats is already published.\n");
+		return -1;
+	}
+
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		printf("memory pool stats open %s failed, errno %d.\n", path, errno);
+		return -1;
+	}
+	if(ftruncate(fd, sizeof(MM_STATS_PAGE)) != 0)
+	{
+		printf("memory pool stats truncate %s failed, errno %d.\n", path, errno);
+		close(fd);
+		return -1;
+	}
+
+	pub = (MM_STATS_PUB*)malloc(sizeof(MM_STATS_PUB));
+	memset(pub, 0, sizeof(MM_STATS_PUB));
+	pub->page = (MM_STATS_PAGE*)mmap(0, sizeof(MM_STATS_PAGE), PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+	close(fd);
+	if(pub->page == MAP_FAILED)
+	{
+		printf("memory pool stats mmap failed, errno %d.\n", errno);
+		free(pub);
+		return -1;
+	}
+
+	pub->g_pool = g_pool;
+	pub->interval_ms = interval_ms > 0 ? interval_ms : 1000;
+	pub->page->pid = (int)getpid();
+	pub->page->interval_ms = pub->interval_ms;
+	pub->page->magic = MM_STATS_MAGIC;
+	pthread_mutex_init(&pub->lock, NULL);
+	pthread_cond_init(&pub->cond, NULL);
+
+	pub->running = 1;
+	ret = pthread_create(&pub->thread, NULL, stats_publish_func, pub);
+	if(ret != 0)
+	{
+		printf("memory pool stats publisher create failed, errno %d.\n", ret);
+		munmap(pub->page, sizeof(MM_STATS_PAGE));
+		pthread_mutex_destroy(&pub->lock);
+		pthread_cond_destroy(&pub->cond);
+		free(pub);
+		return -1;
+	}
+
+	meta->stats_pub = pub;
+	return 0;
+}
+
+void mmpool_stats_unpublish(MM_POOL *g_pool)
+{
+	MM_STATS_PUB *pub = g_pool->meta->stats_pub;
+
+	if(pub == NULL)
+		return;
+
+	pthread_mutex_lock(&pub->lock);
+	pub->running = 0;
+	pthread_cond_signal(&pub->cond);
+	pthread_mutex_unlock(&pub->lock);
+	pthread_join(pub->thread, NULL);
+
+	munmap(pub->page, sizeof(MM_STATS_PAGE));
+	pthread_mutex_destroy(&pub->lock);
+	pthread_cond_destroy(&pub->cond);
+	free(pub);
+	g_pool->meta->stats_pub = NULL;
+}
+
+int mmpool_stats_read(const char *path, MM_STATS_PAGE *page)
+{
+	MM_STATS_PAGE *shared;
+	unsigned long long seq;
+	int fd, retry;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return -1;
+
+	shared = (MM_STATS_PAGE*)mmap(0, sizeof(MM_STATS_PAGE), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(shared == MAP_FAILED)
+		return -1;
+
+	for(retry = 0; retry < 1000; retry++)
+	{
+		seq = shared->seq;
+		__sync_synchronize();
+		if(seq & 1)
+		{
+			sched_yield();
+			continue;
+		}
+
+		memcpy(page, shared, sizeof(MM_STATS_PAGE));
+		__sync_synchronize();
+		if(shared->seq == seq)
+			break;
+	}
+	munmap(shared, sizeof(MM_STATS_PAGE));
+
+	if(retry == 1000 || page->magic != MM_STATS_MAGIC)
+		return -1;
+
+	page->seq = seq;
+	return 0;
+}
+
+void _mmpool_dump(MM_POOL *pool, int all)
+{
+	POOL_META *meta;
+	MM_POOL *cur_pool;
+	int idx = 0;
+
+	printf("---------------------------------- START DUMP MMPOOL ----------------------------------\n");
+	cur_pool = pool;
+	do
+	{
+		MM_BLOCK *mmb;
+		int i;
+
+		MM_POOL_LOCK(cur_pool);
+		printf("*********************************** START THIS POOL **************************************\n");
+		printf("   POOL OVER ALL: start addr [%p] size [%d] freesize [%d] parked [%u] freeblocks: \n",
+			cur_pool->m_addr, cur_pool->size, cur_pool->free_size, cur_pool->quick_size);
 
 		for(i = 0; i < FREEMMB_BUCKET_SIZE; i++)
 		{
@@ -653,15 +2526,34 @@ void _mmpool_dump(MM_POOL *pool, int all)
 
 void mmpool_dump(MM_POOL *g_pool)
 {
-        _mmpool_dump(g_pool, 1);
+	int i;
+
+	for(i = 0; i < g_pool->meta->arena_num; i++)
+	{
+		_mmpool_dump(g_pool->meta->arenas[i], 1);
+	}
 }
 
 void mmpool_dump_counter(MM_POOL *g_pool)
 {
-	int i;
-	POOL_META *meta = g_pool->meta; 
+	int i, j;
+	POOL_META *meta;
 	printf("-------------------------------START DUMP COUNTERS -----------------------------------\n");
-	for(i = 0; i < MAX_COUNTER_SIZE; i++)
-		printf("C[%d]: %lu , ", i, meta->counter[i]);
-	printf("\n");
+	for(j = 0; j < g_pool->meta->arena_num; j++)
+	{
+		meta = g_pool->meta->arenas[j]->meta;
+		if(g_pool->meta->arena_num > 1)
+			printf("ARENA[%d]: ", j);
+		for(i = 0; i < MAX_COUNTER_SIZE; i++)
+			printf("C[%d]: %llu , ", i, meta->counter[i]);
+		printf("\n");
+
+		/* contention of pool locks, to find the hot pools */
+		for(i = 0; i < meta->pool_len; i++)
+		{
+			MM_LOCK *lock = &meta->pool_array[i]->m_lock;
+			printf("   POOL[%d] LOCK: acquires %llu contended %llu wait %llu us\n",
+				i, lock->acquires, lock->contended, lock->wait_ns / 1000);
+		}
+	}
 }
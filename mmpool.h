@@ -4,14 +4,21 @@
 #include <pthread.h>
 #include <stddef.h>
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 typedef struct mm_block
 {
 	void *pool;		/* pointer to pool belongs to, used for free */
 	struct mm_block *prev;	/* prev block for quick merging */
 	unsigned int size;	/* size of this block */
 	int flags;		/* flag for this block */
-	int padding[2];		/* padding to 32 bytes */
+	unsigned int dirty;	/* size of data from start not known zero, the rest is zero */
+	int padding;		/* padding to 32 bytes */
 #define MMB_IN_USE 0x01		/* indicates block is in used */
+#define MMB_DEFERRED 0x02	/* freed but parked in quick list, not merged yet */
+#define MMB_GUARDED 0x04	/* sampled block in guard area, not in any pool */
 	unsigned char align_base;/* start address for real data */
 }MM_BLOCK;
 
@@ -25,6 +32,29 @@ typedef struct mmb_lle
 	MM_BLOCK *mmb;
 }MMB_LLE;
 
+/*
+** Lock of a pool. The default is an adaptive lock, it spins for a while
+** learned from the previous waits before parking on a futex. Build with
+** -DMM_LOCK_PTHREAD for the plain pthread mutex. Both count the profile of
+** contention, updated while the lock is held. The layout is the same for
+** both builds, so objects built either way agree on MM_POOL.
+*/
+typedef struct mm_lock
+{
+	union
+	{
+		pthread_mutex_t mutex;	/* with MM_LOCK_PTHREAD */
+		struct
+		{
+			volatile int state; /* 0 unlocked, 1 locked, 2 locked with waiters */
+			int spin;	/* average spins of recent contended acquisitions */
+		}futex;			/* adaptive lock by default */
+	}impl;
+	unsigned long long acquires;	/* number of acquisitions */
+	unsigned long long contended;	/* acquisitions which had to wait */
+	unsigned long long wait_ns;	/* total time waited for the lock */
+}MM_LOCK;
+
 #define FREEMMB_BUCKET_SIZE 1025
 typedef struct mm_pool
 {
@@ -35,17 +65,50 @@ typedef struct mm_pool
 	unsigned int free_size;		/* free size of this pool */
 	unsigned int free_blocks[FREEMMB_BUCKET_SIZE]; /* bucket free blocks stats */
 	MMB_LLE	*free_blocks_list[FREEMMB_BUCKET_SIZE]; /* bucket free blocks list for quick access*/
-	pthread_mutex_t m_lock; 	/* mutex to protect memory allocation from the current pool */
+	MM_BLOCK *quick_list[FREEMMB_BUCKET_SIZE - 1]; /* freed blocks parked for quick reuse, not merged */
+	unsigned int quick_size;	/* total size of blocks parked in quick list */
+	unsigned int large_max;		/* size of largest free block in the last bucket */
+	MM_LOCK m_lock; 		/* lock to protect memory allocation from the current pool */
 	struct pool_meta *meta; 	/* only for first main pool */
 }MM_POOL;
 
 #define MAX_POOL_NUM 1024		/* assume the pool size not exceed 65G */
-#define MAX_COUNTER_SIZE 10
+#define MAX_COUNTER_SIZE 16
+#define MAX_SPARE_NUM 16		/* max pre-mapped pools kept by provisioner */
+#define MAX_ARENA_NUM 64		/* max arenas of a memory pool */
+#define MAX_CPU_NUM 256			/* CPU number mapped to arenas, modulo for more */
+#define ARENA_BALANCE_OPS 4096		/* allocations per thread between rebalances */
+#define MM_HOT_CLASS_NUM 8		/* max size classes picked as hot */
 typedef struct pool_meta
 {
 	MM_POOL *pool_array[MAX_POOL_NUM]; /* Pool array for all allocated pools. */
 	int pool_weight[MAX_POOL_NUM];	   /* Weight for each pool based on freeblocks */
 	int pool_len;			   /* Total number of current alloacted pools */
+	unsigned int deferred_limit;	   /* max size parked per pool, 0 to merge on free */
+	pthread_mutex_t grow_lock;	   /* single flight for adding new pool */
+	MM_POOL *spare_pools[MAX_SPARE_NUM]; /* pre-mapped pools not in pool_array yet */
+	int spare_len;			   /* number of current spare pools */
+	int spare_low;			   /* low-water mark of spare pools, 0 for none */
+	int spare_prefault;		   /* populate pages of spare pools at mapping */
+	int prov_running;		   /* provisioner thread is running */
+	pthread_t prov_thread;		   /* provisioner thread to map spare pools */
+	pthread_cond_t prov_cond;	   /* wake up provisioner, with grow_lock */
+	struct mm_guard *guard;		   /* guard area for sampled allocations */
+	int arena_num;			   /* number of arenas, 1 for a plain pool */
+	MM_POOL *arenas[MAX_ARENA_NUM];	   /* main pools of arenas, the first is itself */
+	int arena_map[MAX_CPU_NUM];	   /* arena index for each CPU (or thread) */
+	unsigned long long arena_ops[MAX_ARENA_NUM]; /* allocations of arenas at last rebalance */
+	int arena_balancing;		   /* one thread rebalance at a time */
+	struct mm_stats_pub *stats_pub;	   /* shared stats page published */
+	unsigned int hot_limit;		   /* max size parked per pool for hot classes, 0 disabled */
+	unsigned int hot_prewarm;	   /* size prewarmed for a class newly hot */
+	unsigned int hist_samples;	   /* samples since last reconfiguration */
+	unsigned int size_hist[FREEMMB_BUCKET_SIZE - 1]; /* sampled requests by size class, decayed */
+	unsigned char hot_map[FREEMMB_BUCKET_SIZE - 1];	 /* size classes picked as hot */
+	unsigned int hot_class[MM_HOT_CLASS_NUM]; /* block size of hot classes, 0 for none */
+	int adapt_running;		   /* one thread reconfigures at a time */
+	unsigned int prewarm_class[MM_HOT_CLASS_NUM]; /* hot classes to prewarm by provisioner */
+	int prewarm_pending;		   /* prewarm_class is set, with grow_lock */
 	pthread_rwlock_t g_lock;           /* rwlock to protect pool meta. */
 	unsigned long long counter[MAX_COUNTER_SIZE];	   /* conter for internal error checking */
 #define BLK_LIST_INS	 0
@@ -55,10 +118,79 @@ typedef struct pool_meta
 #define POOL_ALL_SIZE	 4
 #define POOL_NUM	 5
 #define POOL_ALLOC_SIZE  6
+#define POOL_QUICK_HIT	 7
+#define POOL_COALESCE	 8
+#define POOL_GROW	 9
+#define POOL_SPARE_HIT	 10
+#define POOL_GUARD_ALLOC 11
+#define POOL_ARENA_MOVE	 12
+#define POOL_ADAPT	 13
+#define POOL_EPOCH_FREE	 14
+#define POOL_ZERO_HIT	 15
 }POOL_META;
 
-#define MM_POOL_LOCK(pool) pthread_mutex_lock(&pool->m_lock)
-#define MM_POOL_UNLOCK(pool) pthread_mutex_unlock(&pool->m_lock)
+/*
+** Stats snapshot of a memory pool, read without taking any lock. Each field
+** is read atomically, but they are not consistent to each other while the
+** pool is in use.
+*/
+#define MM_STATS_HIST_SIZE 12		/* free blocks of 32 << i bytes, the last for larger */
+typedef struct mm_subpool_stats
+{
+	int arena;			/* arena of the pool */
+	unsigned int size;		/* total size of the pool */
+	unsigned int free_size;		/* free size, including parked blocks */
+	unsigned int used_size;		/* size of blocks in use, including heads */
+	unsigned int free_blocks;	/* number of free blocks */
+	unsigned int largest_free;	/* size of the largest free block */
+	unsigned long long lock_acquires;  /* acquisitions of the pool lock */
+	unsigned long long lock_contended; /* acquisitions which had to wait */
+	unsigned long long lock_wait_ns;   /* time waited for the pool lock */
+}MM_SUBPOOL_STATS;
+
+typedef struct mm_pool_stats
+{
+	unsigned long long mapped_size;	/* total size of all pools */
+	unsigned long long alloc_size;	/* size allocated to callers */
+	unsigned long long free_size;	/* free size of all pools */
+	unsigned long long parked_size;	/* size parked by deferred coalescing */
+	unsigned long long free_blocks;	/* number of free blocks */
+	unsigned long long largest_free;/* size of the largest free block */
+	double fragmentation;		/* 1 - sum of largest free of pools / free_size */
+	unsigned long long lock_acquires;  /* pool lock profile summed of pools */
+	unsigned long long lock_contended;
+	unsigned long long lock_wait_ns;
+	unsigned long long hist[MM_STATS_HIST_SIZE]; /* free blocks histogram */
+	unsigned long long counter[MAX_COUNTER_SIZE]; /* counters summed of arenas */
+	unsigned int hot_class[MM_HOT_CLASS_NUM]; /* hot size classes of all arenas, 0 for none */
+	int arena_num;			/* number of arenas */
+	int pool_num;			/* number of pools in pools, up to MAX_POOL_NUM */
+	MM_SUBPOOL_STATS pools[MAX_POOL_NUM];
+}MM_POOL_STATS;
+
+/*
+** Layout of the shared stats page, the stats is updated under a sequence
+** lock, the reader retries while seq is odd or changed after copying.
+*/
+#define MM_STATS_MAGIC 0x5354415453504D4DULL /* "MMPSTATS" */
+typedef struct mm_stats_page
+{
+	unsigned long long magic;	/* MM_STATS_MAGIC */
+	volatile unsigned long long seq;/* odd while updating */
+	unsigned long long update_ts;	/* time of last update in seconds */
+	int pid;			/* process of the memory pool */
+	unsigned int interval_ms;	/* update interval */
+	MM_POOL_STATS stats;
+}MM_STATS_PAGE;
+
+/* Pool locks as of MM_LOCK, also for the locks of the buffer pool. */
+void mmpool_lock_init(MM_LOCK *lock);
+void mmpool_lock_destroy(MM_LOCK *lock);
+void mmpool_lock_acquire(MM_LOCK *lock);
+void mmpool_lock_release(MM_LOCK *lock);
+
+#define MM_POOL_LOCK(pool) mmpool_lock_acquire(&(pool)->m_lock)
+#define MM_POOL_UNLOCK(pool) mmpool_lock_release(&(pool)->m_lock)
 #define MM_POOL_G_RDLOCK(pool) pthread_rwlock_rdlock(&pool->meta->g_lock)
 #define MM_POOL_G_WRLOCK(pool) pthread_rwlock_wrlock(&pool->meta->g_lock)
 #define MM_POOL_G_UNLOCK(pool) pthread_rwlock_unlock(&pool->meta->g_lock)
@@ -93,6 +225,25 @@ typedef struct pool_meta
 */
 MM_POOL *mmpool_init(void);
 
+/*
+** MMPOOL_INIT_ARENAS
+** Purpose:
+**	Initialize a shareable memory pool made of several arenas, each with
+**	its own pools and locks. The allocation picks the arena of the current
+**	CPU (or of the thread when the CPU is unknown), and CPUs are moved from
+**	busy arenas to idle ones when the load is uneven. All the other APIs
+**	take the returned entry as a plain memory pool.
+**
+** Parameters:
+**	int arena_num
+**		number of arenas, 0 for the number of online CPUs. It is
+**	limited to MAX_ARENA_NUM.
+** 
+** Returns:
+**	The pointer of memory pool entry.
+*/
+MM_POOL *mmpool_init_arenas(int arena_num);
+
 
 /*
 ** MMPOOL_DESTROY
@@ -125,6 +276,48 @@ void mmpool_destroy(MM_POOL *pool);
 */
 void *mmpool_malloc(MM_POOL *pool, unsigned int size);
 
+/*
+** MMPOOL_ALIGNED_ALLOC
+** Purpose:
+**      Allocate specific size of memory aligned to the given boundary from
+**	the memory pool, e.g. 64 bytes for cache line or 4096 bytes for I/O.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	unsigned int align
+**		the alignment of the returned address, must be power of 2. The
+**	leading gap of the block is kept in the pool as a free block.
+**	unsigned int size
+**		specific size of memory to be allocated.
+** 
+** Returns:
+**      The pointer of the alloacted memory, NULL for invalid alignment.
+**	Released by mmpool_free as well.
+*/
+void *mmpool_aligned_alloc(MM_POOL *pool, unsigned int align, unsigned int size);
+
+/*
+** MMPOOL_CALLOC
+** Purpose:
+**      Allocate zeroed memory for an array of nmemb elements. Each block
+**	tracks the part of its data not known zero, and the data never used
+**	since mapped is not cleared again. Large blocks are cleared with
+**	non-temporal stores.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	unsigned int nmemb
+**		number of elements.
+**	unsigned int size
+**		size of an element.
+** 
+** Returns:
+**      The pointer of the zeroed memory, NULL for 0 size or overflow.
+*/
+void *mmpool_calloc(MM_POOL *pool, unsigned int nmemb, unsigned int size);
+
 /*
 ** MMPOOL_FREE
 ** Purpose:
@@ -132,13 +325,194 @@ void *mmpool_malloc(MM_POOL *pool, unsigned int size);
 **
 ** Parameters:
 **      void *addr
-**              pointer of the memory to be freeed.
+**              pointer of the memory to be freeed, returned by mmpool_malloc
+**	or mmpool_aligned_alloc.
 ** 
 ** Returns:
 **      The pointer of the alloacted memory.
 */
 void mmpool_free(void *addr);
 
+/*
+** MMPOOL_EPOCH_ENTER
+** Purpose:
+**      Enter a read side critical section of epoch based reclamation. The
+**	blocks retired by mmpool_retire are not freed until all threads in
+**	a critical section at the time have exited it. Sections could nest.
+**
+** Parameters:
+**      None
+** 
+** Returns:
+**      None
+*/
+void mmpool_epoch_enter(void);
+
+/*
+** MMPOOL_EPOCH_EXIT
+** Purpose:
+**      Exit the read side critical section entered by mmpool_epoch_enter.
+**
+** Parameters:
+**      None
+** 
+** Returns:
+**      None
+*/
+void mmpool_epoch_exit(void);
+
+/*
+** MMPOOL_RETIRE
+** Purpose:
+**      Free the memory after a grace period, e.g. a node unlinked from a
+**	lock-free structure which other threads may still read. The blocks
+**	retired are freed in batches by the retiring threads, a batch is
+**	grouped by pool so that each pool is locked once.
+**
+** Parameters:
+**      void *addr
+**              pointer of the memory to be freed, returned by mmpool_malloc
+**	or mmpool_aligned_alloc.
+** 
+** Returns:
+**      None
+*/
+void mmpool_retire(void *addr);
+
+/*
+** MMPOOL_EPOCH_BARRIER
+** Purpose:
+**      Wait for a grace period and free all blocks retired before by all
+**	threads, e.g. before destroying the memory pools. It must not be
+**	called in a critical section.
+**
+** Parameters:
+**      None
+** 
+** Returns:
+**      None
+*/
+void mmpool_epoch_barrier(void);
+
+/*
+** MMPOOL_SET_DEFERRED
+** Purpose:
+**      Enable or disable deferred coalescing. Freed blocks are parked in
+**	quick reuse lists of the pool and served again to the same size
+**	without merging; they are merged in batch when the parked size of
+**	the pool reaches the limit, or when the pool runs out of a fit block.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	unsigned int limit
+**		max size of parked blocks per pool, it bounds the fragmentation
+**	caused by deferring. 0 disables deferring and merges all parked blocks.
+** 
+** Returns:
+**      None
+*/
+void mmpool_set_deferred(MM_POOL *pool, unsigned int limit);
+
+/*
+** MMPOOL_SET_ADAPTIVE
+** Purpose:
+**      Enable or disable adaptive size classes. Request sizes are sampled
+**	into a histogram, and the most requested sizes are picked as hot
+**	classes periodically. Freed blocks of hot classes are parked for
+**	quick reuse like deferred coalescing, even if it is disabled, and a
+**	class newly hot is prewarmed with parked blocks. The prewarming is
+**	done by the provisioner thread if it is running (see
+**	mmpool_provision_start), otherwise by the allocating thread. Each change of the
+**	hot classes is counted by POOL_ADAPT, the classes are in the stats.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	unsigned int limit
+**		max size of parked blocks per pool for hot classes, only used
+**	when deferred coalescing is disabled. 0 disables adaptive classes.
+**	unsigned int prewarm
+**		size of blocks prewarmed for a class newly hot, 0 for none.
+** 
+** Returns:
+**      None
+*/
+void mmpool_set_adaptive(MM_POOL *pool, unsigned int limit, unsigned int prewarm);
+
+/*
+** MMPOOL_FLUSH
+** Purpose:
+**      Merge all blocks parked in quick reuse lists of the memory pool.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+** 
+** Returns:
+**      None
+*/
+void mmpool_flush(MM_POOL *pool);
+
+/*
+** MMPOOL_PROVISION_START
+** Purpose:
+**      Start a background thread keeping spare pools mapped ahead of time,
+**	so that the allocation running out of all pools takes a ready pool
+**	instead of mapping one inline. Called again to change the settings.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	int spare_num
+**		low-water mark of spare pools, from 1 to MAX_SPARE_NUM.
+**	int prefault
+**		non-zero to populate the pages of spare pools at mapping.
+** 
+** Returns:
+**      0 for success, -1 for failure.
+*/
+int mmpool_provision_start(MM_POOL *pool, int spare_num, int prefault);
+
+/*
+** MMPOOL_PROVISION_STOP
+** Purpose:
+**      Stop the background provisioner, the spare pools are kept for use
+**	and released by mmpool_destroy.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+** 
+** Returns:
+**      None
+*/
+void mmpool_provision_stop(MM_POOL *pool);
+
+/*
+** MMPOOL_SET_GUARD
+** Purpose:
+**      Enable sampled guard page allocations to catch memory errors in
+**	production. About one of rate allocations up to a page is placed at
+**	the end of its own page followed by a PROT_NONE guard page, with the
+**	requested size rounded up to 16 only, and the page is kept
+**	inaccessible for a while after free. An overflow or use after free
+**	of such block crashes with a report on stderr.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	unsigned int rate
+**		sample one of rate allocations in average, 0 to stop sampling.
+**	unsigned int slot_num
+**		number of guarded pages, only used by the first call. The
+**	sampling is skipped when all of them are in use or in quarantine.
+** 
+** Returns:
+**      0 for success, -1 for failure.
+*/
+int mmpool_set_guard(MM_POOL *pool, unsigned int rate, unsigned int slot_num);
+
 /*
 ** MMPOOL_DUMP
 ** Purpose:
@@ -155,4 +529,80 @@ void mmpool_dump(MM_POOL *pool);
 
 void mmpool_dump_counter(MM_POOL *g_pool);
 
+/*
+** MMPOOL_GET_STATS
+** Purpose:
+**      Get a stats snapshot of the memory pool without taking any lock, it
+**	does not stall the allocation, so it is fine for production.
+**	The fragmentation is 1 - (sum of the largest free block of each
+**	pool) / (free size of all pools). Pools are separate mappings which
+**	never merge, so it is measured within each pool, and a wholly free
+**	pool counts as not fragmented however many pools there are.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	MM_POOL_STATS *stats
+**		the stats returned.
+** 
+** Returns:
+**      None
+*/
+void mmpool_get_stats(MM_POOL *pool, MM_POOL_STATS *stats);
+
+/*
+** MMPOOL_STATS_PUBLISH
+** Purpose:
+**      Publish the stats of the memory pool to a shared file mapping, e.g.
+**	under /dev/shm, which is updated by a background thread, so that a
+**	monitoring process could read it at any time by mmpool_stats_read.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+**	const char *path
+**		path of the stats file, created or truncated.
+**	unsigned int interval_ms
+**		update interval in milliseconds.
+** 
+** Returns:
+**      0 for success, -1 for failure.
+*/
+int mmpool_stats_publish(MM_POOL *pool, const char *path, unsigned int interval_ms);
+
+/*
+** MMPOOL_STATS_UNPUBLISH
+** Purpose:
+**      Stop updating the shared stats page and unmap it, the file is kept.
+**
+** Parameters:
+**      MM_POOL *pool
+**              the entry of the memory pool.
+** 
+** Returns:
+**      None
+*/
+void mmpool_stats_unpublish(MM_POOL *pool);
+
+/*
+** MMPOOL_STATS_READ
+** Purpose:
+**      Read a consistent copy of the stats from a shared stats page, from
+**	any process.
+**
+** Parameters:
+**      const char *path
+**              path of the stats file.
+**	MM_STATS_PAGE *page
+**		the copy of the stats page returned.
+** 
+** Returns:
+**      0 for success, -1 for failure.
+*/
+int mmpool_stats_read(const char *path, MM_STATS_PAGE *page);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
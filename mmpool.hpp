@@ -0,0 +1,211 @@
+#ifndef _MMPOOL_HPP
+#define _MMPOOL_HPP
+
+/*
+** Header only C++ layer on top of the mmpool C API, so that STL containers
+** could be placed on the memory pool:
+**	mmpool::pool_handle	RAII owner of a MM_POOL.
+**	mmpool::memory_resource	std::pmr::memory_resource over a MM_POOL.
+**	mmpool::allocator<T>	stateless STL allocator, the pool is bound
+**				to a tag type through mmpool::pool_registry.
+** Requires C++17 for std::pmr.
+*/
+
+#include <climits>
+#include <cstddef>
+#include <new>
+#include <memory_resource>
+#include <type_traits>
+
+#include "mmpool.h"
+
+namespace mmpool
+{
+
+/*
+** Max request size of mmpool, a block with its head must fit in unsigned
+** int, and an aligned one with the worst case gap as well.
+*/
+constexpr std::size_t max_request = UINT_MAX - MM_BLOCK_HEAD_SIZE;
+
+/*
+** Allocate bytes with align from pool, pick the plain malloc path when the
+** alignment is already granted by the 32 bytes block head.
+*/
+inline void *allocate(MM_POOL *pool, std::size_t bytes, std::size_t align)
+{
+	void *addr;
+
+	if(align > UINT_MAX || bytes > max_request
+		|| (align > MM_BLOCK_HEAD_SIZE && bytes > max_request - align))
+		throw std::bad_alloc();
+
+	/* mmpool_malloc returns NULL for 0 size, but C++ wants a unique pointer */
+	if(bytes == 0)
+		bytes = 1;
+
+	if(align <= MM_BLOCK_HEAD_SIZE)
+		addr = mmpool_malloc(pool, (unsigned int)bytes);
+	else
+		addr = mmpool_aligned_alloc(pool, (unsigned int)align, (unsigned int)bytes);
+
+	if(addr == NULL)
+		throw std::bad_alloc();
+
+	return addr;
+}
+
+inline void deallocate(void *addr)
+{
+	mmpool_free(addr);
+}
+
+/* RAII handle of a memory pool, the pool is destroyed with the handle. */
+class pool_handle
+{
+public:
+	pool_handle() : m_pool(mmpool_init())
+	{
+		if(m_pool == NULL)
+			throw std::bad_alloc();
+	}
+
+	explicit pool_handle(MM_POOL *pool) noexcept : m_pool(pool) {}
+
+	pool_handle(pool_handle &&other) noexcept : m_pool(other.release()) {}
+
+	pool_handle &operator=(pool_handle &&other) noexcept
+	{
+		if(this != &other)
+			reset(other.release());
+		return *this;
+	}
+
+	pool_handle(const pool_handle &) = delete;
+	pool_handle &operator=(const pool_handle &) = delete;
+
+	~pool_handle() { reset(); }
+
+	MM_POOL *get() const noexcept { return m_pool; }
+
+	MM_POOL *release() noexcept
+	{
+		MM_POOL *pool = m_pool;
+		m_pool = NULL;
+		return pool;
+	}
+
+	void reset(MM_POOL *pool = NULL) noexcept
+	{
+		if(m_pool != NULL)
+			mmpool_destroy(m_pool);
+		m_pool = pool;
+	}
+
+private:
+	MM_POOL *m_pool;
+};
+
+/* std::pmr::memory_resource allocating from a MM_POOL. */
+class memory_resource : public std::pmr::memory_resource
+{
+public:
+	explicit memory_resource(MM_POOL *pool) noexcept : m_pool(pool) {}
+
+	MM_POOL *pool() const noexcept { return m_pool; }
+
+protected:
+	void *do_allocate(std::size_t bytes, std::size_t align) override
+	{
+		return mmpool::allocate(m_pool, bytes, align);
+	}
+
+	void do_deallocate(void *addr, std::size_t, std::size_t) override
+	{
+		mmpool::deallocate(addr);
+	}
+
+	bool do_is_equal(const std::pmr::memory_resource &other) const noexcept override
+	{
+		const memory_resource *res = dynamic_cast<const memory_resource*>(&other);
+		return res != NULL && res->m_pool == m_pool;
+	}
+
+private:
+	MM_POOL *m_pool;
+};
+
+/*
+** Bind a MM_POOL to a tag type, so allocator<T, Tag> carries no state and
+** all its instances compare equal. The pool must be set before the first
+** allocation and outlive all containers using it.
+*/
+struct default_tag {};
+
+template <class Tag>
+struct pool_registry
+{
+	static MM_POOL *&pool() noexcept
+	{
+		static MM_POOL *g_pool = NULL;
+		return g_pool;
+	}
+};
+
+template <class T, class Tag = default_tag>
+class allocator
+{
+public:
+	typedef T value_type;
+	typedef std::true_type is_always_equal;
+
+	template <class U>
+	struct rebind { typedef allocator<U, Tag> other; };
+
+	allocator() noexcept {}
+
+	template <class U>
+	allocator(const allocator<U, Tag> &) noexcept {}
+
+	T *allocate(std::size_t n)
+	{
+		MM_POOL *pool = pool_registry<Tag>::pool();
+
+		if(n > max_request / sizeof(T))
+			throw std::bad_array_new_length();
+
+		/* the alignment is known at compile time, skip the check for usual types */
+		if constexpr (alignof(T) <= MM_BLOCK_HEAD_SIZE)
+		{
+			void *addr = mmpool_malloc(pool, n ? (unsigned int)(n * sizeof(T)) : 1);
+			if(addr == NULL)
+				throw std::bad_alloc();
+			return static_cast<T*>(addr);
+		}
+		else
+		{
+			return static_cast<T*>(mmpool::allocate(pool, n * sizeof(T), alignof(T)));
+		}
+	}
+
+	void deallocate(T *addr, std::size_t) noexcept
+	{
+		mmpool_free(addr);
+	}
+};
+
+template <class T, class U, class Tag>
+inline bool operator==(const allocator<T, Tag> &, const allocator<U, Tag> &) noexcept
+{
+	return true;
+}
+
+template <class T, class U, class Tag>
+inline bool operator!=(const allocator<T, Tag> &, const allocator<U, Tag> &) noexcept
+{
+	return false;
+}
+
+} /* namespace mmpool */
+
+#endif
@@ -0,0 +1,227 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "mmpool.h"
+#include "mmtrace.h"
+
+/*
+** Per thread buffer of trace records. A buffer is only written by its
+** thread, the spin lock is taken by the stop to flush it as well, so it
+** is not contended in the recording. The buffers are never freed, the
+** buffer of an exited thread is reused by the next new thread.
+*/
+typedef struct mm_trace_buf
+{
+	struct mm_trace_buf *next;	/* all buffers for flushing at stop */
+	int lock;			/* spin lock of the buffer */
+	int in_use;			/* owned by a live thread */
+	unsigned int tid;		/* thread id of the owner */
+	unsigned int len;		/* number of records buffered */
+	MM_TRACE_REC rec[MM_TRACE_BUF_SIZE];
+}MM_TRACE_BUF;
+
+volatile int g_mmtrace_on = 0;
+
+static int g_trace_fd = -1;
+static MM_TRACE_BUF *g_trace_bufs = NULL;
+static pthread_mutex_t g_trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t g_trace_key;
+static pthread_once_t g_trace_once = PTHREAD_ONCE_INIT;
+static __thread MM_TRACE_BUF *t_trace_buf = NULL;
+
+#define TRACE_BUF_LOCK(buf) while(__sync_lock_test_and_set(&(buf)->lock, 1)) sched_yield()
+#define TRACE_BUF_UNLOCK(buf) __sync_lock_release(&(buf)->lock)
+
+/* Write the records buffered to the file, the buffer lock must be held. */
+static void trace_buf_flush(MM_TRACE_BUF *buf)
+{
+	if(buf->len == 0)
+		return;
+
+	pthread_mutex_lock(&g_trace_lock);
+	if(g_trace_fd >= 0)
+	{
+		size_t len = buf->len * sizeof(MM_TRACE_REC);
+		const char *p = (const char*)buf->rec;
+
+		while(len > 0)
+		{
+			ssize_t ret = write(g_trace_fd, p, len);
+			if(ret < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				printf("memory pool trace write failed, errno %d.\n", errno);
+				break;
+			}
+			p += ret;
+			len -= ret;
+		}
+	}
+	pthread_mutex_unlock(&g_trace_lock);
+
+	buf->len = 0;
+}
+
+static void trace_thread_exit(void *arg)
+{
+	MM_TRACE_BUF *buf = (MM_TRACE_BUF*)arg;
+
+	TRACE_BUF_LOCK(buf);
+	trace_buf_flush(buf);
+	buf->in_use = 0;
+	TRACE_BUF_UNLOCK(buf);
+}
+
+static void trace_key_init(void)
+{
+	pthread_key_create(&g_trace_key, trace_thread_exit);
+}
+
+static MM_TRACE_BUF *trace_buf_get(void)
+{
+	MM_TRACE_BUF *buf;
+
+	pthread_once(&g_trace_once, trace_key_init);
+
+	pthread_mutex_lock(&g_trace_lock);
+	for(buf = g_trace_bufs; buf != NULL; buf = buf->next)
+	{
+		if(!buf->in_use)
+			break;
+	}
+
+	if(buf == NULL)
+	{
+		buf = (MM_TRACE_BUF*)malloc(sizeof(MM_TRACE_BUF));
+		if(buf == NULL)
+		{
+			pthread_mutex_unlock(&g_trace_lock);
+			return NULL;
+		}
+		memset(buf, 0, sizeof(MM_TRACE_BUF));
+		buf->next = g_trace_bufs;
+		g_trace_bufs = buf;
+	}
+
+	buf->in_use = 1;
+	buf->len = 0;
+	buf->tid = (unsigned int)syscall(SYS_gettid);
+	pthread_mutex_unlock(&g_trace_lock);
+
+	pthread_setspecific(g_trace_key, buf);
+	t_trace_buf = buf;
+
+	return buf;
+}
+
+void mmtrace_record(unsigned int op, const void *addr, unsigned int size, unsigned int align)
+{
+	MM_TRACE_BUF *buf = t_trace_buf;
+	MM_TRACE_REC *rec;
+	struct timespec ts;
+
+	if(buf == NULL)
+	{
+		buf = trace_buf_get();
+		if(buf == NULL)
+			return;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	TRACE_BUF_LOCK(buf);
+	if(!g_mmtrace_on)
+	{
+		/* stopped after the check of the caller */
+		TRACE_BUF_UNLOCK(buf);
+		return;
+	}
+
+	rec = &buf->rec[buf->len];
+	rec->ts = (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	rec->addr = (unsigned long long)(uintptr_t)addr;
+	rec->tid = buf->tid;
+	rec->size = size;
+	rec->align = align;
+	rec->op = op;
+
+	if(++buf->len == MM_TRACE_BUF_SIZE)
+		trace_buf_flush(buf);
+	TRACE_BUF_UNLOCK(buf);
+}
+
+int mmtrace_start(const char *path)
+{
+	MM_TRACE_HEAD head;
+	int fd;
+
+	/* check before the open, it truncates the file of a trace recording */
+	pthread_mutex_lock(&g_trace_lock);
+	if(g_trace_fd >= 0)
+	{
+		pthread_mutex_unlock(&g_trace_lock);
+		printf("memory pool trace is already started.\n");
+		return -1;
+	}
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if(fd < 0)
+	{
+		pthread_mutex_unlock(&g_trace_lock);
+		printf("memory pool trace open %s failed, errno %d.\n", path, errno);
+		return -1;
+	}
+
+	memset(&head, 0, sizeof(head));
+	head.magic = MM_TRACE_MAGIC;
+	head.rec_size = sizeof(MM_TRACE_REC);
+	if(write(fd, &head, sizeof(head)) != sizeof(head))
+	{
+		pthread_mutex_unlock(&g_trace_lock);
+		printf("memory pool trace write failed, errno %d.\n", errno);
+		close(fd);
+		return -1;
+	}
+	g_trace_fd = fd;
+	pthread_mutex_unlock(&g_trace_lock);
+
+	g_mmtrace_on = 1;
+	return 0;
+}
+
+void mmtrace_stop(void)
+{
+	MM_TRACE_BUF *buf;
+
+	g_mmtrace_on = 0;
+
+	/* buffers are only pushed at head, the list from a head taken is stable */
+	pthread_mutex_lock(&g_trace_lock);
+	buf = g_trace_bufs;
+	pthread_mutex_unlock(&g_trace_lock);
+
+	for(; buf != NULL; buf = buf->next)
+	{
+		TRACE_BUF_LOCK(buf);
+		trace_buf_flush(buf);
+		TRACE_BUF_UNLOCK(buf);
+	}
+
+	pthread_mutex_lock(&g_trace_lock);
+	if(g_trace_fd >= 0)
+	{
+		close(g_trace_fd);
+		g_trace_fd = -1;
+	}
+	pthread_mutex_unlock(&g_trace_lock);
+}
@@ -0,0 +1,82 @@
+#ifndef _MMTRACE_H
+#define _MMTRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+** Binary trace of allocation events, written by the recorder in mmtrace.c
+** and read by the replay tool mm_replay. The file is a MM_TRACE_HEAD and
+** then MM_TRACE_REC records, in order of flushing per thread buffers, the
+** reader sorts them by ts to get the order of the events.
+*/
+#define MM_TRACE_MAGIC 0x3145434152544D4DULL /* "MMTRACE1" */
+
+typedef struct mm_trace_head
+{
+	unsigned long long magic;	/* MM_TRACE_MAGIC */
+	unsigned int rec_size;		/* sizeof(MM_TRACE_REC) */
+	unsigned int reserved;
+}MM_TRACE_HEAD;
+
+typedef struct mm_trace_rec
+{
+	unsigned long long ts;		/* nanoseconds of CLOCK_MONOTONIC */
+	unsigned long long addr;	/* address allocated or freed */
+	unsigned int tid;		/* thread id of the caller */
+	unsigned int size;		/* size requested, 0 for free */
+	unsigned int align;		/* alignment requested, 0 for none */
+	unsigned int op;		/* event type as below */
+#define MM_TRACE_MALLOC	1
+#define MM_TRACE_FREE	2
+}MM_TRACE_REC;
+
+#define MM_TRACE_BUF_SIZE 4096		/* records buffered per thread */
+
+extern volatile int g_mmtrace_on;
+
+/*
+** Record an event, the malloc is recorded after it returns and the free is
+** recorded before it runs, so the event of an address reused by another
+** thread is always ordered after the free of it.
+*/
+#define MMTRACE(op, addr, size, align) \
+	do { if(g_mmtrace_on) mmtrace_record((op), (addr), (size), (align)); } while(0)
+
+void mmtrace_record(unsigned int op, const void *addr, unsigned int size, unsigned int align);
+
+/*
+** MMTRACE_START
+** Purpose:
+**      Start recording malloc and free events of all memory pools to a
+**	trace file. The events are buffered per thread and written when the
+**	buffer is full, the thread exits or the recording stops.
+**
+** Parameters:
+**      const char *path
+**              path of the trace file, truncated if it exists.
+**
+** Returns:
+**      0 for success, -1 for failure.
+*/
+int mmtrace_start(const char *path);
+
+/*
+** MMTRACE_STOP
+** Purpose:
+**      Stop recording, flush the events buffered and close the trace file.
+**
+** Parameters:
+**      None
+**
+** Returns:
+**      None
+*/
+void mmtrace_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif